@@ -1,8 +1,19 @@
 #include <cstdlib>
+#include <cctype>
+#include <limits>
 #include <iostream>
 #include <memory>
 #include <utility>
 #include <curl/curl.h>
+#include <zlib.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <boost/asio/ssl/error.hpp>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include <boost/asio.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/program_options.hpp>
@@ -11,390 +22,6054 @@
 #include <condition_variable>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <chrono>
 #include <json.hpp>
 #include <deque>
+#include <map>
+#include <unordered_map>
+#include <fstream>
+#include <random>
+#include <iomanip>
+#include <sstream>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <climits>
+#include <ctime>
 #include <boost/log/utility/setup/console.hpp>
 #include <boost/log/utility/setup/common_attributes.hpp>
+#include <boost/log/utility/setup/formatter_parser.hpp>
 #include <boost/log/expressions.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/log/core.hpp>
+#include <boost/log/sinks/async_frontend.hpp>
+#include <boost/log/sinks/bounded_fifo_queue.hpp>
+#include <boost/log/sinks/block_on_overflow.hpp>
+#include <boost/log/sinks/text_ostream_backend.hpp>
+#include <boost/core/null_deleter.hpp>
 #include <boost/algorithm/string.hpp>
 
 #define LOG(a) BOOST_LOG_TRIVIAL(a)
 
+// Debug tracing is decided once at startup (--debug). Building with 
+// DISABLE_TRACE removes all trace statements at compile time.
+#ifdef DISABLE_TRACE
+static const bool traceEnabled = false;
+#else
+static bool traceEnabled = false;
+#endif
+#define TRACE if (!traceEnabled) {} else LOG(debug)
+
+// Records are written to the console by a background thread. When the 
+// console can't keep up, records below error severity are dropped (and 
+// counted) rather than blocking the caller; errors wait for room in the queue.
+static std::atomic<size_t> droppedLogRecords(0);
+
+class DropBelowErrorOnOverflow : public boost::log::sinks::block_on_overflow {
+	public:
+		template<typename LockT>
+		bool on_overflow(const boost::log::record_view& record, LockT& lock) {
+			auto severity = record[boost::log::trivial::severity];
+			if (severity && *severity >= boost::log::trivial::error) {
+				return block_on_overflow::on_overflow(record, lock);
+			}
+			++droppedLogRecords;
+			return false;
+		}
+};
+
+typedef boost::log::sinks::asynchronous_sink<
+		boost::log::sinks::text_ostream_backend, 
+		boost::log::sinks::bounded_fifo_queue<4096, DropBelowErrorOnOverflow>> LogSink;
+
+static size_t maxLogPayload = 0;
+
+// Streams (a prefix of) a payload into a log record without copying it first.
+class LogPayload {
+	public:
+		LogPayload(const char* data, size_t size) : data(data), size(size) {}
+		LogPayload(const std::string& data) : data(data.data()), size(data.size()) {}
+
+		friend std::ostream& operator<<(std::ostream& os, const LogPayload& payload) {
+			if (maxLogPayload && payload.size > maxLogPayload) {
+				os.write(payload.data, maxLogPayload);
+				return os << "... (" << (payload.size - maxLogPayload) << " more bytes)";
+			}
+			return os.write(payload.data, payload.size);
+		}
+
+	private:
+		const char* data;
+		size_t size;
+};
+
+#if BOOST_VERSION < 106600
+#error "Boost 1.66 or later is required"
+#endif
+#if LIBCURL_VERSION_NUM < 0x074400
+#error "libcurl 7.68 or later is required"
+#endif
+
+// The I/O backend is chosen when building: with io_uring=yes, asio submits 
+// accepts, reads and writes through an io_uring instead of waiting for 
+// readiness with epoll (this needs Boost 1.78 and liburing).
+#if defined(BOOST_ASIO_HAS_IO_URING) && BOOST_VERSION < 107800
+#error "io_uring support requires Boost 1.78 or later"
+#endif
+#ifdef BOOST_ASIO_HAS_IO_URING_AS_DEFAULT
+static const char* const ioBackend = "io_uring";
+#else
+static const char* const ioBackend = "epoll";
+#endif
+
 using boost::asio::ip::tcp;
 using boost::asio::ip::address;
+namespace local = boost::asio::local;
+namespace generic = boost::asio::generic;
 namespace po = boost::program_options;
 
 class Sender {
 	public:
 		virtual void send(const std::string& response, bool close = false) = 0;
+
+		// Whether STARTTLS can be offered
+		virtual bool canStartTLS() const {
+			return false;
+		}
+
+		// Starts the TLS handshake after the next response is sent, ignoring 
+		// any input received in plaintext after the current command.
+		virtual void startTLS() {
+		}
 };
 
-class SMTPMessage {
+using json = nlohmann::json;
+
+// Where messages for a set of recipients are posted to.
+struct Route {
+	Route(size_t index, const std::vector<std::string>& urls, const std::vector<std::string>& headers) : index(index), urls(urls), headers(headers) {}
+
+	size_t index;
+	std::vector<std::string> urls;
+	std::vector<std::string> headers; // In addition to the global headers
+};
+
+// Maps recipients to routes. Route 0 is the default route (--url).
+//
+// Rules are loaded from a JSON file of the form
+//
+//   { "routes": [ { "recipients": [...], "url": "...", "headers": [...] }, ... ] }
+//
+// where a recipient is an address (ops@example.com), a domain (example.com), 
+// a wildcard for all subdomains of a domain (*.example.com), or '*'.
+// The most specific rule wins.
+//
+// Addresses are looked up in a hash table. Domains are looked up in a 
+// trie on the reversed domain labels, which is flattened into contiguous 
+// arrays after loading, so a lookup touches only a few cache lines.
+class RoutingTable {
 	public:
-		SMTPMessage(
-				const std::string& from,
-				const std::vector<std::string>& to,
-				const std::string& data) :
-					from(from),
-					to(to),
-					data(data) {
+		RoutingTable(const std::vector<std::string>& defaultURLs) {
+			routes.emplace_back(0, defaultURLs, std::vector<std::string>());
+			nodes.push_back(Node());
 		}
 
-		const std::string& getFrom() const {
-			return from;
+		void load(const std::string& file) {
+			std::ifstream input(file);
+			if (!input) {
+				throw std::runtime_error("Unable to read routes from " + file);
+			}
+			json config = json::parse(input);
+
+			std::vector<BuildNode> trie(1);
+			for (const auto& rule : config.at("routes")) {
+				std::vector<std::string> urls;
+				const auto& url = rule.at("url");
+				if (url.is_array()) {
+					urls = url.get<std::vector<std::string>>();
+				}
+				else {
+					urls.push_back(url.get<std::string>());
+				}
+				std::vector<std::string> headers;
+				if (rule.count("headers")) {
+					headers = rule["headers"].get<std::vector<std::string>>();
+				}
+				uint32_t route = routes.size();
+				routes.emplace_back(route, urls, headers);
+
+				for (const auto& recipient : rule.at("recipients")) {
+					std::string pattern = boost::algorithm::to_lower_copy(recipient.get<std::string>());
+					if (pattern.find('@') != std::string::npos) {
+						addresses[pattern] = route;
+					}
+					else if (pattern == "*") {
+						trie[0].wildcardRoute = route;
+					}
+					else if (boost::algorithm::starts_with(pattern, "*.")) {
+						trie[addDomain(trie, pattern.substr(2))].wildcardRoute = route;
+					}
+					else {
+						trie[addDomain(trie, pattern)].exactRoute = route;
+					}
+				}
+			}
+			compile(trie);
+			LOG(info) << "Loaded " << (routes.size() - 1) << " routes";
 		}
 
-		const std::vector<std::string>& getTo() const {
-			return to;
+		const Route& resolve(const std::string& recipient) const {
+			std::string address = boost::algorithm::to_lower_copy(getAddress(recipient));
+			auto i = addresses.find(address);
+			if (i != addresses.end()) {
+				return routes[i->second];
+			}
+			auto at = address.rfind('@');
+			return routes[resolveDomain(at == std::string::npos ? address : address.substr(at + 1))];
 		}
 
-		const std::string& getData() const {
-			return data;
+		const std::vector<Route>& getRoutes() const {
+			return routes;
+		}
+
+		// Extracts the address from an envelope address such as '<a@b.c> NOTIFY=NEVER'
+		static std::string getAddress(const std::string& recipient) {
+			auto begin = recipient.find('<');
+			auto end = recipient.find('>', begin);
+			if (begin == std::string::npos || end == std::string::npos) {
+				return boost::algorithm::trim_copy(recipient);
+			}
+			return recipient.substr(begin + 1, end - begin - 1);
 		}
 
 	private:
-		std::string from;
-		std::vector<std::string> to;
-		std::string data;
+		static const uint32_t NoRoute = ~0U;
+
+		struct BuildNode {
+			BuildNode() : exactRoute(NoRoute), wildcardRoute(NoRoute) {}
+			std::map<std::string, size_t> children;
+			uint32_t exactRoute;
+			uint32_t wildcardRoute;
+		};
+
+		struct Node {
+			Node() : firstEdge(0), edgeCount(0), exactRoute(NoRoute), wildcardRoute(NoRoute) {}
+			uint32_t firstEdge;
+			uint32_t edgeCount;
+			uint32_t exactRoute;
+			uint32_t wildcardRoute;
+		};
+
+		struct Edge {
+			uint32_t labelOffset;
+			uint32_t labelSize;
+			uint32_t child;
+		};
+
+		static size_t addDomain(std::vector<BuildNode>& trie, const std::string& domain) {
+			std::vector<std::string> labels;
+			boost::algorithm::split(labels, domain, boost::algorithm::is_any_of("."));
+			size_t node = 0;
+			for (auto label = labels.rbegin(); label != labels.rend(); ++label) {
+				auto i = trie[node].children.find(*label);
+				if (i == trie[node].children.end()) {
+					trie[node].children[*label] = trie.size();
+					node = trie.size();
+					trie.push_back(BuildNode());
+				}
+				else {
+					node = i->second;
+				}
+			}
+			return node;
+		}
+
+		void compile(const std::vector<BuildNode>& trie) {
+			nodes.assign(trie.size(), Node());
+			edges.clear();
+			labels.clear();
+			for (size_t i = 0; i < trie.size(); ++i) {
+				Node& node = nodes[i];
+				node.exactRoute = trie[i].exactRoute;
+				node.wildcardRoute = trie[i].wildcardRoute;
+				node.firstEdge = edges.size();
+				node.edgeCount = trie[i].children.size();
+				// std::map keeps the edges sorted by label
+				for (const auto& child : trie[i].children) {
+					edges.push_back({static_cast<uint32_t>(labels.size()), static_cast<uint32_t>(child.first.size()), static_cast<uint32_t>(child.second)});
+					labels += child.first;
+				}
+			}
+		}
+
+		uint32_t resolveDomain(const std::string& domain) const {
+			uint32_t route = nodes[0].wildcardRoute;
+			const Node* node = &nodes[0];
+			size_t end = domain.size();
+			while (true) {
+				auto dot = domain.rfind('.', end == 0 ? 0 : end - 1);
+				size_t begin = (dot == std::string::npos || dot >= end) ? 0 : dot + 1;
+				const Edge* edge = findEdge(*node, domain.data() + begin, end - begin);
+				if (!edge) {
+					break;
+				}
+				node = &nodes[edge->child];
+				if (begin == 0) {
+					if (node->exactRoute != NoRoute) {
+						route = node->exactRoute;
+					}
+					break;
+				}
+				if (node->wildcardRoute != NoRoute) {
+					route = node->wildcardRoute;
+				}
+				end = begin - 1;
+			}
+			return route == NoRoute ? 0 : route;
+		}
+
+		const Edge* findEdge(const Node& node, const char* label, size_t size) const {
+			auto first = edges.begin() + node.firstEdge;
+			auto last = first + node.edgeCount;
+			auto compare = [this](const Edge& edge, const std::pair<const char*, size_t>& key) {
+				return labels.compare(edge.labelOffset, edge.labelSize, key.first, key.second) < 0;
+			};
+			auto key = std::make_pair(label, size);
+			auto i = std::lower_bound(first, last, key, compare);
+			if (i == last || labels.compare(i->labelOffset, i->labelSize, label, size) != 0) {
+				return NULL;
+			}
+			return &*i;
+		}
+
+		std::vector<Route> routes;
+		std::unordered_map<std::string, uint32_t> addresses;
+		std::vector<Node> nodes;
+		std::vector<Edge> edges;
+		std::string labels;
 };
 
-class SMTPHandler {
+// Incremental base64 decoder.
+// Each of the 4 characters of a group is mapped through its own table to 
+// its bits in the decoded 24-bit value, so a group decodes with 4 loads and 
+// 3 ORs. Invalid characters (line breaks, padding) set a flag bit, and 
+// are handled by a slower path.
+class Base64Decoder {
 	public:
-		virtual void handle(const SMTPMessage& message) = 0;
+		Base64Decoder() : pending(0), pendingSize(0) {}
+
+		void decode(const char* data, size_t size, std::string& output) {
+			const Tables& t = getTables();
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+			const unsigned char* end = p + size;
+
+			// Complete a group from a previous call
+			while (pendingSize > 0 && p != end) {
+				decodeSlow(*p++, output);
+			}
+
+			size_t offset = output.size();
+			output.resize(offset + (end - p) / 4 * 3);
+			char* out = &output[0] + offset;
+			while (end - p >= 4) {
+				uint32_t value = t.d0[p[0]] | t.d1[p[1]] | t.d2[p[2]] | t.d3[p[3]];
+				if (value & Invalid) {
+					break;
+				}
+				out[0] = static_cast<char>(value >> 16);
+				out[1] = static_cast<char>(value >> 8);
+				out[2] = static_cast<char>(value);
+				out += 3;
+				p += 4;
+			}
+			output.resize(out - output.data());
+
+			while (p != end) {
+				decodeSlow(*p++, output);
+			}
+		}
+
+	private:
+		enum : uint32_t { Invalid = 0x01000000 };
+
+		struct Tables {
+			uint32_t d0[256];
+			uint32_t d1[256];
+			uint32_t d2[256];
+			uint32_t d3[256];
+		};
+
+		static const Tables& getTables() {
+			static const Tables tables = createTables();
+			return tables;
+		}
+
+		static Tables createTables() {
+			static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+			Tables tables;
+			std::fill(tables.d0, tables.d0 + 256, static_cast<uint32_t>(Invalid));
+			std::fill(tables.d1, tables.d1 + 256, static_cast<uint32_t>(Invalid));
+			std::fill(tables.d2, tables.d2 + 256, static_cast<uint32_t>(Invalid));
+			std::fill(tables.d3, tables.d3 + 256, static_cast<uint32_t>(Invalid));
+			for (uint32_t i = 0; i < 64; ++i) {
+				unsigned char c = alphabet[i];
+				tables.d0[c] = i << 18;
+				tables.d1[c] = i << 12;
+				tables.d2[c] = i << 6;
+				tables.d3[c] = i;
+			}
+			return tables;
+		}
+
+		void decodeSlow(unsigned char c, std::string& output) {
+			uint32_t value = getTables().d3[c];
+			if (c == '=') {
+				// Padding: flush the partial group
+				if (pendingSize == 2) {
+					output.push_back(static_cast<char>(pending >> 4));
+				}
+				else if (pendingSize == 3) {
+					output.push_back(static_cast<char>(pending >> 10));
+					output.push_back(static_cast<char>(pending >> 2));
+				}
+				pending = 0;
+				pendingSize = 0;
+			}
+			else if (!(value & Invalid)) {
+				pending = (pending << 6) | value;
+				if (++pendingSize == 4) {
+					output.push_back(static_cast<char>(pending >> 16));
+					output.push_back(static_cast<char>(pending >> 8));
+					output.push_back(static_cast<char>(pending));
+					pending = 0;
+					pendingSize = 0;
+				}
+			}
+		}
+
+		uint32_t pending;
+		size_t pendingSize;
 };
 
-using json = nlohmann::json;
+static std::string encodeBase64(const std::string& data) {
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string result;
+	result.reserve((data.size() + 2) / 3 * 4);
+	size_t i = 0;
+	for (; i + 3 <= data.size(); i += 3) {
+		uint32_t value = (static_cast<unsigned char>(data[i]) << 16) | (static_cast<unsigned char>(data[i + 1]) << 8) | static_cast<unsigned char>(data[i + 2]);
+		result.push_back(alphabet[(value >> 18) & 0x3f]);
+		result.push_back(alphabet[(value >> 12) & 0x3f]);
+		result.push_back(alphabet[(value >> 6) & 0x3f]);
+		result.push_back(alphabet[value & 0x3f]);
+	}
+	if (i < data.size()) {
+		uint32_t value = static_cast<unsigned char>(data[i]) << 16;
+		if (i + 1 < data.size()) {
+			value |= static_cast<unsigned char>(data[i + 1]) << 8;
+		}
+		result.push_back(alphabet[(value >> 18) & 0x3f]);
+		result.push_back(alphabet[(value >> 12) & 0x3f]);
+		result.push_back(i + 1 < data.size() ? alphabet[(value >> 6) & 0x3f] : '=');
+		result.push_back('=');
+	}
+	return result;
+}
 
-static size_t curlWriteCallback(void* contents, size_t size, size_t nmemb, void*) {
-	size_t realsize = size * nmemb;
-	LOG(debug) << "HTTP: <- " << std::string((const char*) contents, realsize);
-	return realsize;
+// The values of hex digits, and -1 for other characters
+static const int8_t* getHexDigits() {
+	static const struct HexDigits {
+		HexDigits() {
+			std::fill(values, values + 256, -1);
+			for (int i = 0; i < 10; ++i) {
+				values['0' + i] = static_cast<int8_t>(i);
+			}
+			for (int i = 0; i < 6; ++i) {
+				values['a' + i] = values['A' + i] = static_cast<int8_t>(10 + i);
+			}
+		}
+		int8_t values[256];
+	} digits;
+	return digits.values;
 }
 
-static int curlDebugCallback(CURL*, curl_infotype type, char* data, size_t size, void *) {
-	auto text = boost::algorithm::trim_right_copy(std::string(data, size));
-	switch (type) {
-		case CURLINFO_TEXT:
-			LOG(debug) << "HTTP: " << data;
-			break;
-		case CURLINFO_HEADER_OUT:
-			LOG(debug) << "HTTP: -> H: " << text;
-			break;
-		case CURLINFO_DATA_OUT:
-			break;
-		case CURLINFO_SSL_DATA_OUT:
-			break;
-		case CURLINFO_HEADER_IN:
-			LOG(debug) << "HTTP: <- H: " << text;
-			break;
-		case CURLINFO_DATA_IN:
-			break;
-		case CURLINFO_SSL_DATA_IN:
-			break;
-		default: 
-			return 0;
+static void decodeQuotedPrintable(const std::string& line, std::string& output) {
+	const int8_t* hex = getHexDigits();
+	size_t end = line.size();
+	while (end > 0 && (line[end - 1] == ' ' || line[end - 1] == '\t')) {
+		--end;
+	}
+	bool softBreak = end > 0 && line[end - 1] == '=';
+	if (softBreak) {
+		--end;
+	}
+	for (size_t i = 0; i < end; ++i) {
+		if (line[i] == '=' && i + 2 < end) {
+			int high = hex[static_cast<unsigned char>(line[i + 1])];
+			int low = hex[static_cast<unsigned char>(line[i + 2])];
+			if (high >= 0 && low >= 0) {
+				output.push_back(static_cast<char>((high << 4) | low));
+				i += 2;
+				continue;
+			}
+		}
+		output.push_back(line[i]);
+	}
+	if (!softBreak) {
+		output.push_back('\n');
 	}
-	return 0;
 }
 
-class HTTPPoster : public SMTPHandler {
+// A temporary file that has no name on the file system, so it disappears 
+// when it is closed (or when the process dies).
+// Writes are buffered; flush() must be called before reading.
+class SpillFile {
 	public:
-		HTTPPoster(const std::string& url, const std::vector<std::string>& headers) : 
-				url(url),
-				headers(headers),
-				stopRequested(false) {
-			thread = new std::thread(std::bind(&HTTPPoster::run, this));
+		SpillFile(const std::string& directory) : size(0) {
+			fd = open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+			if (fd < 0) {
+				// Fall back to creating and unlinking a named file
+				std::string path = directory + "/smtp-http-proxy.XXXXXX";
+				fd = mkostemp(&path[0], O_CLOEXEC);
+				if (fd < 0) {
+					throw std::runtime_error("Unable to create temporary file in " + directory + ": " + strerror(errno));
+				}
+				unlink(path.c_str());
+			}
 		}
 
-		virtual void handle(const SMTPMessage& message) override {
-			{
-				std::lock_guard<std::mutex> lock(queueMutex);
-				queue.push_back(message);
+		~SpillFile() {
+			close(fd);
+		}
+
+		SpillFile(const SpillFile&) = delete;
+		SpillFile& operator=(const SpillFile&) = delete;
+
+		void write(const char* data, size_t length) {
+			buffer.append(data, length);
+			size += length;
+			if (buffer.size() >= 65536) {
+				flush();
 			}
-			queueNonEmpty.notify_one();
 		}
 
-		void stop() {
-			stopRequested = true;
-			queueNonEmpty.notify_one();
-			thread->join();
-			delete thread;
-			thread = 0;
+		void write(const std::string& data) {
+			write(data.data(), data.size());
+		}
+
+		void flush() {
+			const char* p = buffer.data();
+			size_t remaining = buffer.size();
+			while (remaining > 0) {
+				ssize_t written = ::write(fd, p, remaining);
+				if (written < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					throw std::runtime_error(std::string("Unable to write temporary file: ") + strerror(errno));
+				}
+				p += written;
+				remaining -= written;
+			}
+			buffer.clear();
+		}
+
+		size_t getSize() const {
+			return size;
+		}
+
+		// Thread-safe: doesn't use the file offset.
+		ssize_t read(size_t offset, char* data, size_t length) const {
+			ssize_t result;
+			do {
+				result = pread(fd, data, length, offset);
+			} while (result < 0 && errno == EINTR);
+			return result;
+		}
+
+		// The whole contents, read back into memory
+		std::string readAll() const {
+			std::string data(size, '\0');
+			size_t offset = 0;
+			ssize_t result = 0;
+			while (offset < data.size() && (result = read(offset, &data[offset], data.size() - offset)) > 0) {
+				offset += result;
+			}
+			if (offset < data.size()) {
+				throw std::runtime_error(std::string("Unable to read temporary file: ") + (result < 0 ? strerror(errno) : "unexpected end of file"));
+			}
+			return data;
+		}
+
+	private:
+		int fd;
+		size_t size;
+		std::string buffer;
+};
+
+// How incoming messages are stored and parsed
+struct MessageOptions {
+	MessageOptions() : parseMIME(false), parseHAProxyAlerts(false), spillSize(0), spillDirectory("/tmp") {}
+
+	bool parseMIME;
+	bool parseHAProxyAlerts;
+	std::string haproxySender; // Messages from this address are always parsed as HAProxy alerts
+	size_t spillSize; // Message data and attachments above this size go to a SpillFile (0 = never)
+	std::string spillDirectory;
+};
+
+// The structure of a parsed MIME message
+struct MIMEContent {
+	struct Attachment {
+		std::string filename;
+		std::string contentType;
+		size_t size;
+		std::string data; // base64
+		std::shared_ptr<const SpillFile> file; // Decoded data, if the attachment was spilled to disk
+	};
+
+	std::vector<std::pair<std::string, std::string>> headers;
+	std::string text;
+	std::string html;
+	std::vector<Attachment> attachments;
+};
+
+// Parses a MIME message incrementally, line by line, as it is received.
+// Text and HTML parts are decoded as they arrive. Base64 encoded 
+// attachments are kept in their encoded form, unless they grow beyond the
+// spill size, in which case they are decoded into a SpillFile.
+class MIMEParser {
+	public:
+		MIMEParser(const MessageOptions& options) : options(options), content(std::make_shared<MIMEContent>()), state(Headers), depth(0) {
+		}
+
+		void receive(const std::string& line) {
+			if (state == Headers) {
+				receiveHeader(line);
+				return;
+			}
+			if (!boundaries.empty() && line.size() > 2 && line[0] == '-' && line[1] == '-' && receiveBoundary(line)) {
+				return;
+			}
+			if (state == Body) {
+				receiveBody(line);
+			}
+		}
+
+		std::shared_ptr<const MIMEContent> finish() {
+			if (state == Body) {
+				finishPart();
+			}
+			state = Skip;
+			return content;
+		}
+
+	private:
+		enum State { Headers, Body, Skip };
+		enum Kind { Text, HTML, Attachment };
+
+		struct Part {
+			Part() : kind(Text), base64(false), quotedPrintable(false) {}
+
+			std::string contentType;
+			std::string contentDisposition;
+			std::string contentTransferEncoding;
+			Kind kind;
+			bool base64;
+			bool quotedPrintable;
+			std::string filename;
+			std::string body;
+			Base64Decoder decoder;
+			std::shared_ptr<SpillFile> file;
+		};
+
+		void receiveHeader(const std::string& line) {
+			if (line.empty()) {
+				finishHeaders();
+			}
+			else if ((line[0] == ' ' || line[0] == '\t') && !partHeaders.empty()) {
+				partHeaders.back().second += " " + boost::algorithm::trim_copy(line);
+			}
+			else {
+				auto colon = line.find(':');
+				if (colon != std::string::npos) {
+					partHeaders.emplace_back(line.substr(0, colon), boost::algorithm::trim_copy(line.substr(colon + 1)));
+				}
+			}
+		}
+
+		void finishHeaders() {
+			part = Part();
+			for (const auto& header : partHeaders) {
+				if (boost::algorithm::iequals(header.first, "Content-Type")) {
+					part.contentType = header.second;
+				}
+				else if (boost::algorithm::iequals(header.first, "Content-Disposition")) {
+					part.contentDisposition = header.second;
+				}
+				else if (boost::algorithm::iequals(header.first, "Content-Transfer-Encoding")) {
+					part.contentTransferEncoding = boost::algorithm::to_lower_copy(header.second);
+				}
+			}
+			if (depth == 0) {
+				content->headers = std::move(partHeaders);
+			}
+			partHeaders.clear();
+			++depth;
+
+			std::string type = getValue(part.contentType);
+			if (type.empty()) {
+				type = "text/plain";
+			}
+			if (boost::algorithm::starts_with(type, "multipart/")) {
+				std::string boundary = getParameter(part.contentType, "boundary");
+				if (!boundary.empty()) {
+					boundaries.push_back("--" + boundary);
+					state = Skip;
+					return;
+				}
+			}
+
+			part.filename = getParameter(part.contentDisposition, "filename");
+			if (part.filename.empty()) {
+				part.filename = getParameter(part.contentType, "name");
+			}
+			if (getValue(part.contentDisposition) == "attachment" || !part.filename.empty()) {
+				part.kind = Attachment;
+			}
+			else if (type == "text/plain") {
+				part.kind = Text;
+			}
+			else if (type == "text/html") {
+				part.kind = HTML;
+			}
+			else {
+				part.kind = Attachment;
+			}
+			part.contentType = type;
+			part.base64 = part.contentTransferEncoding == "base64";
+			part.quotedPrintable = part.contentTransferEncoding == "quoted-printable";
+			state = Body;
+		}
+
+		// Returns true if the line is a boundary of one of the enclosing multiparts.
+		bool receiveBoundary(const std::string& line) {
+			std::string trimmed = boost::algorithm::trim_right_copy(line);
+			for (size_t i = boundaries.size(); i-- > 0;) {
+				const std::string& boundary = boundaries[i];
+				if (!boost::algorithm::starts_with(trimmed, boundary)) {
+					continue;
+				}
+				bool closing = trimmed.size() == boundary.size() + 2 && boost::algorithm::ends_with(trimmed, "--");
+				if (trimmed.size() != boundary.size() && !closing) {
+					continue;
+				}
+				if (state == Body) {
+					finishPart();
+				}
+				boundaries.resize(i + 1);
+				if (closing) {
+					boundaries.pop_back();
+					state = Skip;
+				}
+				else {
+					state = Headers;
+				}
+				return true;
+			}
+			return false;
+		}
+
+		void receiveBody(const std::string& line) {
+			if (part.file) {
+				if (part.base64) {
+					part.decoder.decode(line.data(), line.size(), part.body);
+				}
+				else {
+					part.body += line;
+					part.body += '\n';
+				}
+				part.file->write(part.body);
+				part.body.clear();
+			}
+			else if (part.base64 && part.kind == Attachment) {
+				part.body += boost::algorithm::trim_copy(line);
+				if (options.spillSize > 0 && part.body.size() > options.spillSize) {
+					spillPart();
+				}
+			}
+			else if (part.base64) {
+				part.decoder.decode(line.data(), line.size(), part.body);
+			}
+			else if (part.quotedPrintable) {
+				decodeQuotedPrintable(line, part.body);
+			}
+			else {
+				part.body += line;
+				part.body += '\n';
+				if (part.kind == Attachment && options.spillSize > 0 && part.body.size() > options.spillSize) {
+					spillPart();
+				}
+			}
+		}
+
+		void spillPart() {
+			part.file = std::make_shared<SpillFile>(options.spillDirectory);
+			if (part.base64) {
+				std::string decoded;
+				part.decoder.decode(part.body.data(), part.body.size(), decoded);
+				part.file->write(decoded);
+			}
+			else {
+				part.file->write(part.body);
+			}
+			part.body.clear();
+			part.body.shrink_to_fit();
+		}
+
+		void finishPart() {
+			switch (part.kind) {
+				case Text:
+					content->text += part.body;
+					break;
+				case HTML:
+					content->html += part.body;
+					break;
+				case Attachment:
+					if (part.file) {
+						part.file->flush();
+						content->attachments.push_back({part.filename, part.contentType, part.file->getSize(), std::string(), std::move(part.file)});
+					}
+					else if (part.base64) {
+						// Every character before the padding holds 6 bits (so malformed 
+						// data, e.g. only padding, can't underflow)
+						size_t end = part.body.find_last_not_of('=');
+						size_t size = (end == std::string::npos ? 0 : end + 1) * 3 / 4;
+						content->attachments.push_back({part.filename, part.contentType, size, std::move(part.body), nullptr});
+					}
+					else {
+						content->attachments.push_back({part.filename, part.contentType, part.body.size(), encodeBase64(part.body), nullptr});
+					}
+					break;
+			}
+			part.body.clear();
+		}
+
+		// Returns the value of a header without its parameters.
+		static std::string getValue(const std::string& header) {
+			return boost::algorithm::to_lower_copy(boost::algorithm::trim_copy(header.substr(0, header.find(';'))));
+		}
+
+		static std::string getParameter(const std::string& header, const std::string& name) {
+			std::vector<std::string> parameters;
+			boost::algorithm::split(parameters, header, boost::algorithm::is_any_of(";"));
+			for (size_t i = 1; i < parameters.size(); ++i) {
+				auto equals = parameters[i].find('=');
+				if (equals == std::string::npos) {
+					continue;
+				}
+				if (boost::algorithm::iequals(boost::algorithm::trim_copy(parameters[i].substr(0, equals)), name)) {
+					return boost::algorithm::trim_copy_if(boost::algorithm::trim_copy(parameters[i].substr(equals + 1)), boost::algorithm::is_any_of("\""));
+				}
+			}
+			return std::string();
+		}
+
+		const MessageOptions& options;
+		std::shared_ptr<MIMEContent> content;
+		State state;
+		size_t depth;
+		std::vector<std::pair<std::string, std::string>> partHeaders;
+		std::vector<std::string> boundaries;
+		Part part;
+};
+
+// The fields of a HAProxy email-alert, such as
+//   Server my-backend/mysrv is DOWN, reason: Layer4 timeout, check duration: 2001ms. 
+//   0 active and 0 backup servers left. 0 sessions active, 0 requeued, 0 remaining in queue.
+struct HAProxyAlert {
+	std::string proxy;
+	std::string server;
+	bool backupServer; // "Backup Server ..."
+	std::string state;
+	boost::optional<std::string> reason;
+	boost::optional<long> code;
+	boost::optional<std::string> info;
+	boost::optional<long> checkDuration; // ms
+	boost::optional<long> activeServers;
+	boost::optional<long> backupServers;
+	bool runningOnBackup;
+	boost::optional<long> activeSessions;
+	boost::optional<long> requeuedSessions;
+	boost::optional<long> queuedSessions;
+
+	json toJSON() const {
+		json j = {
+			{"proxy", proxy},
+			{"server", server},
+			{"backupServer", backupServer},
+			{"state", state}
+		};
+		if (reason) { j["reason"] = *reason; }
+		if (code) { j["code"] = *code; }
+		if (info) { j["info"] = *info; }
+		if (checkDuration) { j["checkDuration"] = *checkDuration; }
+		if (activeServers) { j["activeServers"] = *activeServers; }
+		if (backupServers) { j["backupServers"] = *backupServers; }
+		j["runningOnBackup"] = runningOnBackup;
+		if (activeSessions) { j["activeSessions"] = *activeSessions; }
+		if (requeuedSessions) { j["requeuedSessions"] = *requeuedSessions; }
+		if (queuedSessions) { j["queuedSessions"] = *queuedSessions; }
+		return j;
+	}
+};
+
+// Parses the fixed layout of HAProxy's email-alert messages with a single 
+// scan over the alert text (the subject, or else the first body line).
+class HAProxyAlertParser {
+	public:
+		// Returns an empty pointer if the data is not a HAProxy alert.
+		// If knownSender is set, the body is parsed even without the alert subject.
+		static std::shared_ptr<const HAProxyAlert> parse(const std::string& data, bool knownSender) {
+			static const std::string subjectPrefix = "[HAproxy Alert] ";
+			size_t headersEnd = data.find("\n\n");
+			if (headersEnd == std::string::npos) {
+				return nullptr;
+			}
+			boost::optional<std::string> text;
+			size_t lineStart = 0;
+			while (lineStart < headersEnd) {
+				size_t lineEnd = data.find('\n', lineStart);
+				if (data.compare(lineStart, 9, "Subject: ") == 0) {
+					std::string subject = data.substr(lineStart + 9, lineEnd - lineStart - 9);
+					if (boost::algorithm::starts_with(subject, subjectPrefix)) {
+						text = subject.substr(subjectPrefix.size());
+					}
+					break;
+				}
+				lineStart = lineEnd + 1;
+			}
+			if (!text && knownSender) {
+				size_t bodyStart = data.find_first_not_of('\n', headersEnd);
+				if (bodyStart != std::string::npos) {
+					text = data.substr(bodyStart, data.find('\n', bodyStart) - bodyStart);
+					if (boost::algorithm::starts_with(*text, subjectPrefix)) {
+						text = text->substr(subjectPrefix.size());
+					}
+				}
+			}
+			if (!text) {
+				return nullptr;
+			}
+			boost::algorithm::trim_right(*text);
+			return parseAlert(*text);
+		}
+
+	private:
+		static std::shared_ptr<const HAProxyAlert> parseAlert(const std::string& text) {
+			auto alert = std::make_shared<HAProxyAlert>();
+			alert->runningOnBackup = false;
+			const char* p = text.c_str();
+			alert->backupServer = skip(p, "Backup ");
+			if (!skip(p, "Server ")) {
+				return nullptr;
+			}
+			const char* slash = strchr(p, '/');
+			const char* is = strstr(p, " is ");
+			if (!slash || !is || slash > is) {
+				return nullptr;
+			}
+			alert->proxy.assign(p, slash);
+			alert->server.assign(slash + 1, is);
+			p = is + 4;
+			alert->state = readUntil(p, ",.");
+
+			// ", reason: ..., code: ..., info: \"...\", check duration: ...ms"
+			while (skip(p, ", ")) {
+				if (skip(p, "reason: ")) {
+					alert->reason = readUntil(p, ",.");
+				}
+				else if (skip(p, "code: ")) {
+					alert->code = readNumber(p);
+				}
+				else if (skip(p, "info: \"")) {
+					const char* end = strchr(p, '"');
+					if (!end) {
+						return nullptr;
+					}
+					alert->info = std::string(p, end);
+					p = end + 1;
+				}
+				else if (skip(p, "check duration: ")) {
+					alert->checkDuration = readNumber(p);
+					skip(p, "ms");
+				}
+				else {
+					readUntil(p, ",.");
+				}
+			}
+
+			// Sentences: server counts, backup status, session counts
+			while (skip(p, ".")) {
+				skip(p, " ");
+				if (*p == '\0') {
+					break;
+				}
+				if (skip(p, "Running on backup")) {
+					alert->runningOnBackup = true;
+					continue;
+				}
+				boost::optional<long> first = readNumber(p);
+				if (!first) {
+					readUntil(p, ".");
+				}
+				else if (skip(p, " active and ")) {
+					alert->activeServers = first;
+					alert->backupServers = readNumber(p);
+					readUntil(p, ".");
+				}
+				else if (skip(p, " sessions active, ")) {
+					alert->activeSessions = first;
+					alert->requeuedSessions = readNumber(p);
+					skip(p, " requeued, ");
+					alert->queuedSessions = readNumber(p);
+					readUntil(p, ".");
+				}
+				else if (skip(p, " sessions requeued, ")) {
+					alert->requeuedSessions = first;
+					alert->queuedSessions = readNumber(p);
+					readUntil(p, ".");
+				}
+				else {
+					readUntil(p, ".");
+				}
+			}
+			return alert;
+		}
+
+		static bool skip(const char*& p, const char* prefix) {
+			size_t length = strlen(prefix);
+			if (strncmp(p, prefix, length) != 0) {
+				return false;
+			}
+			p += length;
+			return true;
+		}
+
+		// Reads up to (not including) one of the delimiters, or the end.
+		// A '.' only counts as a delimiter when followed by a space or the end.
+		static std::string readUntil(const char*& p, const char* delimiters) {
+			const char* start = p;
+			for (; *p != '\0'; ++p) {
+				if (*p == '.' && p[1] != ' ' && p[1] != '\0') {
+					continue;
+				}
+				if (strchr(delimiters, *p)) {
+					break;
+				}
+			}
+			return std::string(start, p);
+		}
+
+		static boost::optional<long> readNumber(const char*& p) {
+			char* end;
+			long value = strtol(p, &end, 10);
+			if (end == p) {
+				return boost::none;
+			}
+			p = end;
+			return value;
+		}
+};
+
+class SMTPMessage {
+	public:
+		SMTPMessage(
+				const std::string& from,
+				const std::vector<std::string>& to,
+				const std::vector<const Route*>& routes,
+				std::shared_ptr<const std::string> data,
+				std::shared_ptr<const MIMEContent> mimeContent = std::shared_ptr<const MIMEContent>(),
+				std::shared_ptr<const SpillFile> dataFile = std::shared_ptr<const SpillFile>()) :
+					from(from),
+					to(to),
+					routes(routes),
+					data(std::move(data)),
+					mimeContent(std::move(mimeContent)),
+					dataFile(std::move(dataFile)),
+					duplicates(0) {
+		}
+
+		const std::string& getFrom() const {
+			return from;
+		}
+
+		const std::vector<std::string>& getTo() const {
+			return to;
+		}
+
+		// The route of each recipient
+		const std::vector<const Route*>& getRoutes() const {
+			return routes;
+		}
+
+		const std::string& getData() const {
+			return *data;
+		}
+
+		// The data is immutable, and shared by all copies of the message.
+		const std::shared_ptr<const std::string>& getSharedData() const {
+			return data;
+		}
+
+		// Only available when MIME parsing is enabled
+		const std::shared_ptr<const MIMEContent>& getMIMEContent() const {
+			return mimeContent;
+		}
+
+		// Set if the data was too large to keep in memory. The data is then
+		// only available from the file (getData() is empty).
+		const std::shared_ptr<const SpillFile>& getDataFile() const {
+			return dataFile;
+		}
+
+		size_t getDataSize() const {
+			return dataFile ? dataFile->getSize() : data->size();
+		}
+
+		// Only available when HAProxy alert parsing is enabled
+		const std::shared_ptr<const HAProxyAlert>& getHAProxyAlert() const {
+			return haproxyAlert;
+		}
+
+		void setHAProxyAlert(std::shared_ptr<const HAProxyAlert> alert) {
+			haproxyAlert = std::move(alert);
+		}
+
+		// Set on summaries of aggregated HAProxy alerts
+		const std::shared_ptr<const json>& getHAProxySummary() const {
+			return haproxySummary;
+		}
+
+		void setHAProxySummary(std::shared_ptr<const json> summary) {
+			haproxySummary = std::move(summary);
+		}
+
+		// The address of the SMTP client that sent the message (empty for 
+		// messages created by the proxy itself)
+		const std::string& getClientAddress() const {
+			return clientAddress;
+		}
+
+		void setClientAddress(const std::string& address) {
+			clientAddress = address;
+		}
+
+		// Set by the deduplicator, so notices of suppressed duplicates can 
+		// refer to the message
+		const std::string& getID() const {
+			return id;
+		}
+
+		void setID(const std::string& value) {
+			id = value;
+		}
+
+		// Set on notices (without data) that this many duplicates of the 
+		// message with the same ID were suppressed
+		size_t getDuplicates() const {
+			return duplicates;
+		}
+
+		void setDuplicates(size_t count) {
+			duplicates = count;
+		}
+
+		// Whether the data or any attachment was spilled to disk
+		bool isSpilled() const {
+			if (dataFile) {
+				return true;
+			}
+			if (mimeContent) {
+				for (const auto& attachment : mimeContent->attachments) {
+					if (attachment.file) {
+						return true;
+					}
+				}
+			}
+			return false;
+		}
+
+	private:
+		std::string from;
+		std::vector<std::string> to;
+		std::vector<const Route*> routes;
+		std::shared_ptr<const std::string> data;
+		std::shared_ptr<const MIMEContent> mimeContent;
+		std::shared_ptr<const SpillFile> dataFile;
+		std::shared_ptr<const HAProxyAlert> haproxyAlert;
+		std::shared_ptr<const json> haproxySummary;
+		std::string clientAddress;
+		std::string id;
+		size_t duplicates;
+};
+
+class SMTPHandler {
+	public:
+		virtual void handle(const SMTPMessage& message) = 0;
+};
+
+// The last handler, which delivers messages.
+class MessageSink : public SMTPHandler {
+	public:
+		typedef std::function<void(std::vector<SMTPMessage>)> DrainHandler;
+
+		virtual ~MessageSink() {}
+
+		// Stops taking messages from the queue, waits for the deliveries in 
+		// progress, and calls the handler (on the event loop) with the messages 
+		// that were not delivered.
+		virtual void drain(DrainHandler handler) = 0;
+
+		virtual void stop() = 0;
+};
+
+static size_t curlWriteCallback(void* contents, size_t size, size_t nmemb, void*) {
+	size_t realsize = size * nmemb;
+	TRACE << "HTTP: <- " << LogPayload((const char*) contents, realsize);
+	return realsize;
+}
+
+static int curlDebugCallback(CURL*, curl_infotype type, char* data, size_t size, void *) {
+	while (size > 0 && std::isspace(static_cast<unsigned char>(data[size - 1]))) {
+		--size;
+	}
+	switch (type) {
+		case CURLINFO_TEXT:
+			TRACE << "HTTP: " << LogPayload(data, size);
+			break;
+		case CURLINFO_HEADER_OUT:
+			TRACE << "HTTP: -> H: " << LogPayload(data, size);
+			break;
+		case CURLINFO_HEADER_IN:
+			TRACE << "HTTP: <- H: " << LogPayload(data, size);
+			break;
+		default: 
+			break;
+	}
+	return 0;
+}
+
+struct CompressionOptions {
+	enum Method { None, Gzip, Zstd };
+
+	CompressionOptions() : method(None), minSize(0) {}
+
+	Method method;
+	boost::optional<int> level; // Default level of the method if not set
+	size_t minSize;
+};
+
+// A request body assembled from segments, which can be shared with other 
+// requests (e.g. the encoded message data when a message is fanned out).
+class RequestBody {
+	public:
+		RequestBody() : size_(0), segment(0), offset(0) {}
+
+		void append(std::shared_ptr<const std::string> data) {
+			size_ += data->size();
+			segments.push_back(std::move(data));
+		}
+
+		void append(std::string data) {
+			append(std::make_shared<const std::string>(std::move(data)));
+		}
+
+		size_t size() const {
+			return size_;
+		}
+
+		bool atEnd() const {
+			return segment == segments.size();
+		}
+
+		// Returns (and consumes) the next contiguous piece of data
+		std::pair<const char*, size_t> next(size_t maxSize) {
+			while (!atEnd() && offset == segments[segment]->size()) {
+				++segment;
+				offset = 0;
+			}
+			if (atEnd()) {
+				return std::make_pair(static_cast<const char*>(NULL), 0);
+			}
+			const std::string& data = *segments[segment];
+			size_t size = std::min(maxSize, data.size() - offset);
+			auto result = std::make_pair(data.data() + offset, size);
+			offset += size;
+			if (offset == data.size()) {
+				++segment;
+				offset = 0;
+			}
+			return result;
+		}
+
+		size_t read(char* buffer, size_t size) {
+			size_t result = 0;
+			while (result < size && !atEnd()) {
+				auto chunk = next(size - result);
+				std::copy(chunk.first, chunk.first + chunk.second, buffer + result);
+				result += chunk.second;
+			}
+			return result;
+		}
+
+		void rewind() {
+			segment = 0;
+			offset = 0;
+		}
+
+		const std::vector<std::shared_ptr<const std::string>>& getSegments() const {
+			return segments;
+		}
+
+	private:
+		std::vector<std::shared_ptr<const std::string>> segments;
+		size_t size_;
+		size_t segment;
+		size_t offset;
+};
+
+// Compresses a request body incrementally, as curl asks for more upload data.
+class BodyCompressor {
+	public:
+		BodyCompressor(RequestBody& input) : input(input) {}
+
+		virtual ~BodyCompressor() {}
+
+		virtual const char* getContentEncoding() const = 0;
+
+		// Returns the number of bytes written, or 0 when the body is complete.
+		virtual size_t read(char* buffer, size_t size) = 0;
+
+		virtual void rewind() = 0;
+
+		static std::unique_ptr<BodyCompressor> create(const CompressionOptions& options, RequestBody& input);
+
+	protected:
+		RequestBody& input;
+};
+
+class GzipCompressor : public BodyCompressor {
+	public:
+		GzipCompressor(RequestBody& input, int level) : BodyCompressor(input), finished(false) {
+			stream.zalloc = Z_NULL;
+			stream.zfree = Z_NULL;
+			stream.opaque = Z_NULL;
+			stream.next_in = Z_NULL;
+			stream.avail_in = 0;
+			// 16 + window bits selects the gzip format
+			if (deflateInit2(&stream, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				throw std::runtime_error("Error initializing gzip compression");
+			}
+		}
+
+		~GzipCompressor() {
+			deflateEnd(&stream);
+		}
+
+		virtual const char* getContentEncoding() const override {
+			return "gzip";
+		}
+
+		virtual size_t read(char* buffer, size_t size) override {
+			stream.next_out = reinterpret_cast<Bytef*>(buffer);
+			stream.avail_out = size;
+			while (!finished && stream.avail_out == size) {
+				if (stream.avail_in == 0) {
+					auto chunk = input.next(std::numeric_limits<uInt>::max());
+					stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(chunk.first));
+					stream.avail_in = chunk.second;
+				}
+				auto ret = deflate(&stream, input.atEnd() ? Z_FINISH : Z_NO_FLUSH);
+				if (ret == Z_STREAM_END) {
+					finished = true;
+				}
+				else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+					throw std::runtime_error("Error during gzip compression");
+				}
+			}
+			return size - stream.avail_out;
+		}
+
+		virtual void rewind() override {
+			deflateReset(&stream);
+			input.rewind();
+			stream.avail_in = 0;
+			finished = false;
+		}
+
+	private:
+		z_stream stream;
+		bool finished;
+};
+
+#ifdef HAVE_ZSTD
+class ZstdCompressor : public BodyCompressor {
+	public:
+		ZstdCompressor(RequestBody& input, int level) : BodyCompressor(input), context(ZSTD_createCCtx()), finished(false) {
+			if (!context) {
+				throw std::runtime_error("Error initializing zstd compression");
+			}
+			ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, level);
+			ZSTD_CCtx_setPledgedSrcSize(context, input.size());
+			inBuffer = { NULL, 0, 0 };
+		}
+
+		~ZstdCompressor() {
+			ZSTD_freeCCtx(context);
+		}
+
+		virtual const char* getContentEncoding() const override {
+			return "zstd";
+		}
+
+		virtual size_t read(char* buffer, size_t size) override {
+			ZSTD_outBuffer outBuffer = { buffer, size, 0 };
+			while (!finished && outBuffer.pos == 0) {
+				if (inBuffer.pos == inBuffer.size) {
+					auto chunk = input.next(std::numeric_limits<size_t>::max());
+					inBuffer = { chunk.first, chunk.second, 0 };
+				}
+				auto remaining = ZSTD_compressStream2(context, &outBuffer, &inBuffer, input.atEnd() ? ZSTD_e_end : ZSTD_e_continue);
+				if (ZSTD_isError(remaining)) {
+					throw std::runtime_error(std::string("Error during zstd compression: ") + ZSTD_getErrorName(remaining));
+				}
+				finished = input.atEnd() && remaining == 0;
+			}
+			return outBuffer.pos;
+		}
+
+		virtual void rewind() override {
+			ZSTD_CCtx_reset(context, ZSTD_reset_session_only);
+			ZSTD_CCtx_setPledgedSrcSize(context, input.size());
+			input.rewind();
+			inBuffer = { NULL, 0, 0 };
+			finished = false;
+		}
+
+	private:
+		ZSTD_CCtx* context;
+		ZSTD_inBuffer inBuffer;
+		bool finished;
+};
+#endif
+
+std::unique_ptr<BodyCompressor> BodyCompressor::create(const CompressionOptions& options, RequestBody& input) {
+	if (input.size() < options.minSize) {
+		return std::unique_ptr<BodyCompressor>();
+	}
+	switch (options.method) {
+		case CompressionOptions::Gzip:
+			return std::unique_ptr<BodyCompressor>(new GzipCompressor(input, options.level.value_or(Z_DEFAULT_COMPRESSION)));
+#ifdef HAVE_ZSTD
+		case CompressionOptions::Zstd:
+			return std::unique_ptr<BodyCompressor>(new ZstdCompressor(input, options.level.value_or(ZSTD_CLEVEL_DEFAULT)));
+#endif
+		default:
+			return std::unique_ptr<BodyCompressor>();
+	}
+}
+
+static size_t curlBodyReadCallback(char* buffer, size_t size, size_t nitems, void* userdata) {
+	return static_cast<RequestBody*>(userdata)->read(buffer, size * nitems);
+}
+
+static int curlBodySeekCallback(void* userdata, curl_off_t offset, int origin) {
+	if (offset != 0 || origin != SEEK_SET) {
+		return CURL_SEEKFUNC_CANTSEEK;
+	}
+	static_cast<RequestBody*>(userdata)->rewind();
+	return CURL_SEEKFUNC_OK;
+}
+
+static size_t curlCompressedReadCallback(char* buffer, size_t size, size_t nitems, void* userdata) {
+	try {
+		return static_cast<BodyCompressor*>(userdata)->read(buffer, size * nitems);
+	}
+	catch (const std::exception& e) {
+		LOG(error) << e.what();
+		return CURL_READFUNC_ABORT;
+	}
+}
+
+static int curlCompressedSeekCallback(void* userdata, curl_off_t offset, int origin) {
+	if (offset != 0 || origin != SEEK_SET) {
+		return CURL_SEEKFUNC_CANTSEEK;
+	}
+	static_cast<BodyCompressor*>(userdata)->rewind();
+	return CURL_SEEKFUNC_OK;
+}
+
+// A part of a multipart/form-data request, read from memory or from disk
+struct FormPart {
+	std::string name;
+	std::string filename;
+	std::string contentType;
+	std::shared_ptr<const std::string> data;
+	std::shared_ptr<const SpillFile> file;
+
+	size_t size() const {
+		return file ? file->getSize() : data->size();
+	}
+};
+
+// The read state of a FormPart in a single request
+struct FormPartReader {
+	FormPartReader(const FormPart& part) : part(part), offset(0) {}
+
+	const FormPart& part;
+	size_t offset;
+};
+
+static size_t curlFormReadCallback(char* buffer, size_t size, size_t nitems, void* userdata) {
+	auto reader = static_cast<FormPartReader*>(userdata);
+	size_t length = std::min(size * nitems, reader->part.size() - reader->offset);
+	if (reader->part.file) {
+		ssize_t result = reader->part.file->read(reader->offset, buffer, length);
+		if (result < 0) {
+			LOG(error) << "Unable to read temporary file: " << strerror(errno);
+			return CURL_READFUNC_ABORT;
+		}
+		length = result;
+	}
+	else {
+		memcpy(buffer, reader->part.data->data() + reader->offset, length);
+	}
+	reader->offset += length;
+	return length;
+}
+
+static int curlFormSeekCallback(void* userdata, curl_off_t offset, int origin) {
+	auto reader = static_cast<FormPartReader*>(userdata);
+	if (origin != SEEK_SET || offset < 0 || static_cast<size_t>(offset) > reader->part.size()) {
+		return CURL_SEEKFUNC_CANTSEEK;
+	}
+	reader->offset = offset;
+	return CURL_SEEKFUNC_OK;
+}
+
+static void curlFormFreeCallback(void* userdata) {
+	delete static_cast<FormPartReader*>(userdata);
+}
+
+struct HTTPOptions {
+	enum Balancing { LeastOutstanding, LatencyEWMA };
+	enum FanOut { PerRoute, PerRecipient };
+
+	HTTPOptions() : 
+			http2(false), 
+			maxConnections(1), 
+			maxStreams(100), 
+			balancing(LeastOutstanding), 
+			ejectAfterFailures(3), 
+			ejectSeconds(30), 
+			healthCheckInterval(10),
+			fanOut(PerRoute) {
+	}
+
+	bool http2;
+	long maxConnections; // Per upstream
+	long maxStreams; // Concurrent HTTP/2 streams per connection
+	Balancing balancing;
+	int ejectAfterFailures;
+	int ejectSeconds;
+	std::string healthCheckPath; // Empty = no active health checks
+	int healthCheckInterval;
+	FanOut fanOut;
+	std::string unixSocket; // Connect to this instead of the URLs' hosts
+};
+
+// The set of URLs messages can be posted to, with their health and load.
+// Only used from the HTTPPoster thread.
+class UpstreamPool {
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+		struct Upstream {
+			Upstream(const std::string& url) : url(url), outstanding(0), latency(0), failures(0), probing(false) {}
+
+			bool isEjected(Clock::time_point now) const {
+				return ejectedUntil && now < *ejectedUntil;
+			}
+
+			std::string url;
+			std::string healthCheckURL;
+			size_t outstanding;
+			double latency; // EWMA, in seconds
+			int failures; // Consecutive
+			boost::optional<Clock::time_point> ejectedUntil;
+			bool probing;
+		};
+
+		UpstreamPool(const std::vector<std::string>& urls, const HTTPOptions& options) : options(options), next(0) {
+			for (const auto& url : urls) {
+				upstreams.emplace_back(url);
+				if (!options.healthCheckPath.empty()) {
+					upstreams.back().healthCheckURL = getHealthCheckURL(url, options.healthCheckPath);
+				}
+			}
+		}
+
+		size_t size() const {
+			return upstreams.size();
+		}
+
+		std::vector<Upstream>& getUpstreams() {
+			return upstreams;
+		}
+
+		// Picks the upstream for the next request, avoiding the ones in 
+		// 'exclude' (e.g. those a request already failed on) if possible.
+		// When all other upstreams are ejected, they are all considered.
+		Upstream& select(const std::vector<const Upstream*>& exclude = std::vector<const Upstream*>()) {
+			auto now = Clock::now();
+			double meanLatency = getMeanLatency();
+			Upstream* best = NULL;
+			for (int pass = 0; pass < 3 && !best; ++pass) {
+				for (size_t i = 0; i < upstreams.size(); ++i) {
+					// Start at a rotating offset, so ties are spread evenly
+					auto& upstream = upstreams[(next + i) % upstreams.size()];
+					if (pass < 2 && std::find(exclude.begin(), exclude.end(), &upstream) != exclude.end()) {
+						continue;
+					}
+					if (pass == 0 && upstream.isEjected(now)) {
+						continue;
+					}
+					if (!best || getLoad(upstream, meanLatency) < getLoad(*best, meanLatency)) {
+						best = &upstream;
+					}
+				}
+			}
+			next = (next + 1) % upstreams.size();
+			return *best;
+		}
+
+		void reportResult(Upstream& upstream, bool success, double latency) {
+			if (success) {
+				upstream.latency = upstream.latency == 0 ? latency : (0.8 * upstream.latency + 0.2 * latency);
+				upstream.failures = 0;
+				upstream.ejectedUntil = boost::none;
+			}
+			else if (++upstream.failures >= options.ejectAfterFailures) {
+				eject(upstream);
+			}
+		}
+
+		void reportHealthCheck(Upstream& upstream, bool healthy) {
+			if (healthy) {
+				if (upstream.ejectedUntil) {
+					LOG(info) << "Upstream " << upstream.url << " is healthy again";
+				}
+				upstream.failures = 0;
+				upstream.ejectedUntil = boost::none;
+			}
+			else {
+				eject(upstream);
+			}
+		}
+
+	private:
+		// Upstreams without latency samples yet are assumed to have the mean 
+		// latency, so they don't get all requests until their first response.
+		double getLoad(const Upstream& upstream, double meanLatency) const {
+			if (options.balancing == HTTPOptions::LatencyEWMA) {
+				return (upstream.latency == 0 ? meanLatency : upstream.latency) * (upstream.outstanding + 1);
+			}
+			return upstream.outstanding;
+		}
+
+		double getMeanLatency() const {
+			double total = 0;
+			size_t samples = 0;
+			for (const auto& upstream : upstreams) {
+				if (upstream.latency != 0) {
+					total += upstream.latency;
+					++samples;
+				}
+			}
+			return samples ? total / samples : 0;
+		}
+
+		void eject(Upstream& upstream) {
+			if (!upstream.isEjected(Clock::now())) {
+				LOG(warning) << "Ejecting upstream " << upstream.url << " for " << options.ejectSeconds << "s";
+			}
+			upstream.ejectedUntil = Clock::now() + std::chrono::seconds(options.ejectSeconds);
+		}
+
+		static std::string getHealthCheckURL(const std::string& url, const std::string& path) {
+			std::shared_ptr<CURLU> curlURL(curl_url(), curl_url_cleanup);
+			char* result = NULL;
+			if (curl_url_set(curlURL.get(), CURLUPART_URL, url.c_str(), 0) != CURLUE_OK 
+					|| curl_url_set(curlURL.get(), CURLUPART_PATH, path.c_str(), 0) != CURLUE_OK 
+					|| curl_url_set(curlURL.get(), CURLUPART_QUERY, NULL, 0) != CURLUE_OK
+					|| curl_url_get(curlURL.get(), CURLUPART_URL, &result, 0) != CURLUE_OK) {
+				throw std::runtime_error("Invalid URL: " + url);
+			}
+			std::string healthCheckURL(result);
+			curl_free(result);
+			return healthCheckURL;
+		}
+
+		HTTPOptions options;
+		std::vector<Upstream> upstreams;
+		size_t next;
+};
+
+// A class of messages that gets its own share of the HTTP requests.
+struct Lane {
+	Lane(const std::string& name, size_t weight, std::chrono::milliseconds latencyBudget) : name(name), weight(weight), latencyBudget(latencyBudget) {}
+
+	bool hasRules() const {
+		return !recipients.empty() || !senders.empty() || !headers.empty();
+	}
+
+	std::string name;
+	size_t weight;
+	std::chrono::milliseconds latencyBudget; // 0 = none
+	std::vector<std::string> recipients; // Addresses or domains
+	std::vector<std::string> senders; // Addresses or domains
+	std::vector<std::pair<std::string, std::string>> headers; // Name and part of the value
+};
+
+// Assigns messages to lanes. Without configuration, there is a single 
+// default lane.
+//
+// Lanes are loaded from a JSON file of the form
+//
+//   { "lanes": [ { "name": "...", "weight": 10, "latencyBudget": 500, 
+//                  "recipients": [...], "senders": [...], "headers": { "X-Priority": "1" } }, ... ] }
+//
+// A message goes to the first lane with a matching recipient, sender, or 
+// header (whose value contains the given text). A lane without rules 
+// matches all messages; if there is none, a default lane with weight 1 
+// is added.
+class PriorityLanes {
+	public:
+		PriorityLanes() : matchHeaders(false) {
+			lanes.emplace_back("default", 1, std::chrono::milliseconds(0));
+		}
+
+		void load(const std::string& file) {
+			std::ifstream input(file);
+			if (!input) {
+				throw std::runtime_error("Unable to read lanes from " + file);
+			}
+			json config = json::parse(input);
+
+			lanes.clear();
+			for (const auto& rule : config.at("lanes")) {
+				lanes.emplace_back(
+						rule.at("name").get<std::string>(), 
+						rule.count("weight") ? rule["weight"].get<size_t>() : 1, 
+						std::chrono::milliseconds(rule.count("latencyBudget") ? rule["latencyBudget"].get<int>() : 0));
+				Lane& lane = lanes.back();
+				if (lane.weight == 0) {
+					throw std::runtime_error("Lane " + lane.name + " has weight 0");
+				}
+				if (rule.count("recipients")) {
+					for (const auto& recipient : rule["recipients"]) {
+						lane.recipients.push_back(boost::algorithm::to_lower_copy(recipient.get<std::string>()));
+					}
+				}
+				if (rule.count("senders")) {
+					for (const auto& sender : rule["senders"]) {
+						lane.senders.push_back(boost::algorithm::to_lower_copy(sender.get<std::string>()));
+					}
+				}
+				if (rule.count("headers")) {
+					for (auto header = rule["headers"].begin(); header != rule["headers"].end(); ++header) {
+						lane.headers.emplace_back(header.key(), header.value().get<std::string>());
+						matchHeaders = true;
+					}
+				}
+			}
+			if (lanes.empty() || lanes.back().hasRules()) {
+				lanes.emplace_back("default", 1, std::chrono::milliseconds(0));
+			}
+			LOG(info) << "Loaded " << lanes.size() << " lanes";
+		}
+
+		size_t classify(const SMTPMessage& message) const {
+			if (lanes.size() == 1) {
+				return 0;
+			}
+			std::vector<std::pair<std::string, std::string>> messageHeaders;
+			if (matchHeaders) {
+				messageHeaders = parseHeaders(message.getData());
+			}
+			std::string from = boost::algorithm::to_lower_copy(RoutingTable::getAddress(message.getFrom()));
+			std::vector<std::string> to;
+			for (const auto& recipient : message.getTo()) {
+				to.push_back(boost::algorithm::to_lower_copy(RoutingTable::getAddress(recipient)));
+			}
+			for (size_t i = 0; i < lanes.size(); ++i) {
+				const Lane& lane = lanes[i];
+				if (!lane.hasRules() || matchesAddress(lane.senders, from)) {
+					return i;
+				}
+				for (const auto& recipient : to) {
+					if (matchesAddress(lane.recipients, recipient)) {
+						return i;
+					}
+				}
+				for (const auto& rule : lane.headers) {
+					for (const auto& header : messageHeaders) {
+						if (boost::algorithm::iequals(header.first, rule.first) && boost::algorithm::icontains(header.second, rule.second)) {
+							return i;
+						}
+					}
+				}
+			}
+			return lanes.size() - 1;
+		}
+
+		const std::vector<Lane>& getLanes() const {
+			return lanes;
+		}
+
+	private:
+		static bool matchesAddress(const std::vector<std::string>& patterns, const std::string& address) {
+			auto at = address.rfind('@');
+			for (const auto& pattern : patterns) {
+				if (pattern == address || (at != std::string::npos && address.compare(at + 1, std::string::npos, pattern) == 0)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// Spilled messages have no data in memory, and so no headers to match.
+		static std::vector<std::pair<std::string, std::string>> parseHeaders(const std::string& data) {
+			std::vector<std::pair<std::string, std::string>> result;
+			size_t begin = 0;
+			while (begin < data.size()) {
+				size_t end = data.find('\n', begin);
+				if (end == std::string::npos) {
+					end = data.size();
+				}
+				std::string line = data.substr(begin, end - begin);
+				begin = end + 1;
+				boost::algorithm::trim_right(line);
+				if (line.empty()) {
+					break;
+				}
+				if ((line[0] == ' ' || line[0] == '\t') && !result.empty()) {
+					result.back().second += " " + boost::algorithm::trim_copy(line);
+				}
+				else {
+					auto colon = line.find(':');
+					if (colon != std::string::npos) {
+						result.emplace_back(line.substr(0, colon), boost::algorithm::trim_copy(line.substr(colon + 1)));
+					}
+				}
+			}
+			return result;
+		}
+
+		std::vector<Lane> lanes;
+		bool matchHeaders;
+};
+
+// Queue of messages waiting for an HTTP request, shared fairly between 
+// lanes and, within a lane, between client addresses.
+// Lanes are served with deficit round robin: each turn, a lane can send 
+// as many messages as its weight. Within a lane, clients take turns, so a 
+// backlog of one client doesn't hold up the others. 
+// A message that has waited longer than its lane's latency budget is sent 
+// first (lanes are checked in configuration order).
+// Not thread-safe.
+class FairQueue {
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+		FairQueue(const std::vector<Lane>& lanes) : current(0), count(0) {
+			for (const auto& lane : lanes) {
+				queues.emplace_back(lane);
+			}
+		}
+
+		bool empty() const {
+			return count == 0;
+		}
+
+		void push(SMTPMessage message, size_t lane) {
+			LaneQueue& queue = queues[lane];
+			auto& clientQueue = queue.clients[message.getClientAddress()];
+			if (clientQueue.empty()) {
+				queue.active.push_back(message.getClientAddress());
+			}
+			clientQueue.push_back({std::move(message), Clock::now()});
+			++queue.count;
+			++count;
+		}
+
+		SMTPMessage pop() {
+			auto now = Clock::now();
+			for (auto& queue : queues) {
+				if (queue.count > 0 && queue.lane.latencyBudget.count() > 0) {
+					size_t oldest = getOldestClient(queue);
+					if (now - queue.clients[queue.active[oldest]].front().queued >= queue.lane.latencyBudget) {
+						TRACE << "Latency budget of lane " << queue.lane.name << " exceeded";
+						return pop(queue, oldest);
+					}
+				}
+			}
+			while (true) {
+				LaneQueue& queue = queues[current];
+				if (queue.count > 0 && queue.credit > 0) {
+					--queue.credit;
+					return pop(queue, 0);
+				}
+				if (queue.count == 0) {
+					queue.credit = 0;
+				}
+				current = (current + 1) % queues.size();
+				queues[current].credit += queues[current].lane.weight;
+			}
+		}
+
+	private:
+		struct Entry {
+			SMTPMessage message;
+			Clock::time_point queued;
+		};
+
+		struct LaneQueue {
+			LaneQueue(const Lane& lane) : lane(lane), credit(0), count(0) {}
+
+			const Lane& lane;
+			std::unordered_map<std::string, std::deque<Entry>> clients;
+			std::deque<std::string> active; // Clients with queued messages, in turn
+			size_t credit;
+			size_t count;
+		};
+
+		static size_t getOldestClient(LaneQueue& queue) {
+			size_t oldest = 0;
+			for (size_t i = 1; i < queue.active.size(); ++i) {
+				if (queue.clients[queue.active[i]].front().queued < queue.clients[queue.active[oldest]].front().queued) {
+					oldest = i;
+				}
+			}
+			return oldest;
+		}
+
+		// Takes the next message of the given client, and puts the client at 
+		// the back of the line.
+		SMTPMessage pop(LaneQueue& queue, size_t client) {
+			std::string clientAddress = std::move(queue.active[client]);
+			queue.active.erase(queue.active.begin() + client);
+			auto i = queue.clients.find(clientAddress);
+			SMTPMessage message = std::move(i->second.front().message);
+			i->second.pop_front();
+			if (i->second.empty()) {
+				queue.clients.erase(i);
+			}
+			else {
+				queue.active.push_back(std::move(clientAddress));
+			}
+			--queue.count;
+			--count;
+			return message;
+		}
+
+		std::vector<LaneQueue> queues;
+		size_t current;
+		size_t count;
+};
+
+// A request for (the recipients of one route of) a message
+struct EncodedRequest {
+	EncodedRequest(const Route* route) : route(route) {}
+
+	const Route* route;
+	RequestBody body; // JSON
+	std::vector<FormPart> form; // If not empty, posted instead of the (JSON) body
+};
+
+// Turns messages into HTTP requests.
+class RequestEncoder {
+	public:
+		RequestEncoder(const std::vector<Route>& routes, const HTTPOptions& options) : routes(routes), options(options) {}
+
+		// One request for every route (or recipient), with the recipients of 
+		// that route in the envelope.
+		// All requests share the encoded message data.
+		// Messages that were (partially) spilled to disk are streamed from disk
+		// as multipart/form-data instead of being encoded as JSON.
+		std::vector<EncodedRequest> encode(const SMTPMessage& message) const {
+			std::vector<EncodedRequest> requests;
+			std::vector<std::pair<const Route*, std::vector<std::string>>> deliveries;
+			for (size_t i = 0; i < message.getTo().size(); ++i) {
+				const Route* route = message.getRoutes()[i];
+				auto delivery = std::find_if(deliveries.begin(), deliveries.end(), [route](const std::pair<const Route*, std::vector<std::string>>& d) { return d.first == route; });
+				if (delivery == deliveries.end() || options.fanOut == HTTPOptions::PerRecipient) {
+					deliveries.emplace_back(route, std::vector<std::string>());
+					delivery = deliveries.end() - 1;
+				}
+				delivery->second.push_back(message.getTo()[i]);
+			}
+			if (deliveries.empty()) {
+				deliveries.emplace_back(&routes[0], std::vector<std::string>());
+			}
+
+			if (message.getDuplicates() > 0) {
+				for (const auto& delivery : deliveries) {
+					requests.emplace_back(delivery.first);
+					requests.back().body = createNotice(message, delivery.second);
+				}
+				return requests;
+			}
+
+			if (message.isSpilled()) {
+				auto form = createForm(message);
+				for (const auto& delivery : deliveries) {
+					json envelope = {
+						{"from", message.getFrom()},
+						{"to", delivery.second}
+					};
+					LOG(info) << "Processing message: " << message.getDataSize() << " bytes (multipart), envelope: " << envelope.dump();
+
+					requests.emplace_back(delivery.first);
+					EncodedRequest* request = &requests.back();
+					request->form.push_back({"envelope", std::string(), "application/json", std::make_shared<const std::string>(envelope.dump()), nullptr});
+					if (message.getHAProxyAlert()) {
+						request->form.push_back({"haproxy", std::string(), "application/json", std::make_shared<const std::string>(message.getHAProxyAlert()->toJSON().dump()), nullptr});
+					}
+					if (message.getHAProxySummary()) {
+						request->form.push_back({"haproxySummary", std::string(), "application/json", std::make_shared<const std::string>(message.getHAProxySummary()->dump()), nullptr});
+					}
+					if (!message.getID().empty()) {
+						request->form.push_back({"id", std::string(), "text/plain", std::make_shared<const std::string>(message.getID()), nullptr});
+					}
+					request->form.insert(request->form.end(), form.begin(), form.end());
+				}
+				return requests;
+			}
+
+			auto fields = encodeFields(message, message.getData());
+			for (const auto& delivery : deliveries) {
+				requests.emplace_back(delivery.first);
+				requests.back().body = createBody(fields, message, delivery.second);
+			}
+			return requests;
+		}
+
+		// The whole message, with all its recipients, as a single JSON object.
+		// Spilled message data and attachments are read back from disk.
+		static RequestBody encodeJSON(const SMTPMessage& message) {
+			if (message.getDuplicates() > 0) {
+				return createNotice(message, message.getTo());
+			}
+			if (const auto& file = message.getDataFile()) {
+				return createBody(encodeFields(message, file->readAll()), message, message.getTo());
+			}
+			return createBody(encodeFields(message, message.getData()), message, message.getTo());
+		}
+
+		// The message data, the parsed MIME structure (as JSON), and the decoded 
+		// attachments.
+		static std::vector<FormPart> createForm(const SMTPMessage& message) {
+			std::vector<FormPart> form;
+			form.push_back({"data", std::string(), "message/rfc822", message.getSharedData(), message.getDataFile()});
+			if (const auto& content = message.getMIMEContent()) {
+				form.push_back({"mime", std::string(), "application/json", std::make_shared<const std::string>(encodeMIME(*content, false).dump()), nullptr});
+				for (const auto& attachment : content->attachments) {
+					FormPart part = {"attachment", attachment.filename, attachment.contentType, nullptr, attachment.file};
+					if (!attachment.file) {
+						auto data = std::make_shared<std::string>();
+						Base64Decoder().decode(attachment.data.data(), attachment.data.size(), *data);
+						part.data = data;
+					}
+					form.push_back(part);
+				}
+			}
+			return form;
+		}
+
+		static json encodeMIME(const MIMEContent& content, bool includeAttachmentData) {
+			json j;
+			j["headers"] = json::array();
+			for (const auto& header : content.headers) {
+				j["headers"].push_back({{"name", header.first}, {"value", header.second}});
+			}
+			j["text"] = content.text;
+			j["html"] = content.html;
+			j["attachments"] = json::array();
+			for (const auto& attachment : content.attachments) {
+				json a = {
+					{"filename", attachment.filename},
+					{"contentType", attachment.contentType},
+					{"size", attachment.size}
+				};
+				if (includeAttachmentData) {
+					a["data"] = attachment.file ? encodeBase64(attachment.file->readAll()) : attachment.data;
+				}
+				j["attachments"].push_back(a);
+			}
+			return j;
+		}
+
+	private:
+		// The parts of the JSON body that are the same for all requests
+		struct JSONFields {
+			std::shared_ptr<const std::string> data;
+			std::shared_ptr<const std::string> mime; // NULL = not parsed
+			std::shared_ptr<const std::string> haproxy; // NULL = not an alert
+		};
+
+		static JSONFields encodeFields(const SMTPMessage& message, const std::string& data) {
+			JSONFields fields;
+			fields.data = std::make_shared<const std::string>(json(data).dump());
+			if (message.getMIMEContent()) {
+				std::string object = encodeMIME(*message.getMIMEContent(), true).dump();
+				fields.mime = std::make_shared<const std::string>("," + object.substr(1, object.size() - 2));
+			}
+			if (message.getHAProxyAlert()) {
+				fields.haproxy = std::make_shared<const std::string>(",\"haproxy\":" + message.getHAProxyAlert()->toJSON().dump());
+			}
+			else if (message.getHAProxySummary()) {
+				fields.haproxy = std::make_shared<const std::string>(",\"haproxySummary\":" + message.getHAProxySummary()->dump());
+			}
+			return fields;
+		}
+
+		static RequestBody createBody(const JSONFields& fields, const SMTPMessage& message, const std::vector<std::string>& to) {
+			static const std::shared_ptr<const std::string> dataPrefix = std::make_shared<const std::string>("{\"data\":");
+			json envelope = {
+				{"from", message.getFrom()},
+				{"to", to}
+			};
+			std::string envelopeSuffix = ",\"envelope\":" + envelope.dump() + "}";
+			if (!message.getID().empty()) {
+				envelopeSuffix = ",\"id\":" + json(message.getID()).dump() + envelopeSuffix;
+			}
+
+			LOG(info) << "Processing message: " << LogPayload(*fields.data) << envelopeSuffix;
+
+			RequestBody body;
+			body.append(dataPrefix);
+			body.append(fields.data);
+			if (fields.mime) {
+				body.append(fields.mime);
+			}
+			if (fields.haproxy) {
+				body.append(fields.haproxy);
+			}
+			body.append(std::move(envelopeSuffix));
+			return body;
+		}
+
+		// A notice (without data) of the duplicates of a message that were suppressed
+		static RequestBody createNotice(const SMTPMessage& message, const std::vector<std::string>& to) {
+			json notice = {
+				{"duplicateOf", message.getID()},
+				{"duplicates", message.getDuplicates()},
+				{"envelope", {
+					{"from", message.getFrom()},
+					{"to", to}
+				}}
+			};
+			std::string encoded = notice.dump();
+			LOG(info) << "Processing duplicate notice: " << encoded;
+
+			RequestBody body;
+			body.append(std::move(encoded));
+			return body;
+		}
+
+		const std::vector<Route>& routes;
+		HTTPOptions options;
+};
+
+// Posts messages from a separate thread. Transfers run concurrently on 
+// curl's multi interface, which keeps connections alive between requests, 
+// and multiplexes requests over them when HTTP/2 is used.
+class HTTPPoster : public MessageSink {
+	public:
+		HTTPPoster(const RoutingTable& routingTable, const PriorityLanes& lanes, const std::vector<std::string>& headers, const CompressionOptions& compression, const HTTPOptions& options) : 
+				routes(routingTable.getRoutes()),
+				lanes(lanes),
+				encoder(routingTable.getRoutes(), options),
+				headers(headers),
+				compression(compression),
+				options(options),
+				stopRequested(false),
+				drainRequested(false),
+				queue(lanes.getLanes()) {
+			size_t upstreamCount = 0;
+			for (const auto& route : routingTable.getRoutes()) {
+				upstreams.emplace_back(new UpstreamPool(route.urls, options));
+				upstreamCount += route.urls.size();
+			}
+			multi = curl_multi_init();
+			curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+			curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, options.maxConnections);
+			curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, options.maxStreams);
+			maxTransfers = upstreamCount * std::max<long>(1, options.http2 ? options.maxConnections * options.maxStreams : options.maxConnections);
+			thread = new std::thread(std::bind(&HTTPPoster::run, this));
+		}
+
+		~HTTPPoster() {
+			curl_multi_cleanup(multi);
+		}
+
+		virtual void handle(const SMTPMessage& message) override {
+			size_t lane = lanes.classify(message);
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				queue.push(message, lane);
+			}
+			queueNonEmpty.notify_one();
+			curl_multi_wakeup(multi);
+		}
+
+		virtual void stop() override {
+			stopRequested = true;
+			join();
+		}
+
+		// Blocks the event loop until the requests in flight have finished.
+		virtual void drain(DrainHandler handler) override {
+			drainRequested = true;
+			join();
+			std::vector<SMTPMessage> result;
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				while (!queue.empty()) {
+					result.push_back(queue.pop());
+				}
+			}
+			handler(std::move(result));
+		}
+
+	private:
+		typedef UpstreamPool::Upstream Upstream;
+
+		struct Transfer {
+			Transfer(const Route& route, Upstream& upstream) : curl(curl_easy_init()), headers(NULL), mime(NULL), route(route), upstream(upstream), healthCheck(false) {}
+
+			~Transfer() {
+				curl_slist_free_all(headers);
+				curl_easy_cleanup(curl);
+				curl_mime_free(mime);
+			}
+
+			CURL* curl;
+			struct curl_slist* headers;
+			curl_mime* mime;
+			RequestBody body;
+			std::vector<FormPart> form; // If not empty, posted instead of the (JSON) body
+			std::unique_ptr<BodyCompressor> compressor;
+			const Route& route;
+			Upstream& upstream;
+			std::vector<const Upstream*> tried; // Upstreams that failed before this one
+			bool healthCheck;
+		};
+
+		void join() {
+			if (!thread) {
+				return;
+			}
+			queueNonEmpty.notify_one();
+			curl_multi_wakeup(multi);
+			thread->join();
+			delete thread;
+			thread = 0;
+		}
+
+		void run() {
+			std::vector<SMTPMessage> messages;
+			auto nextHealthCheck = UpstreamPool::Clock::now();
+			while (!stopRequested && !(drainRequested && transfers.empty())) {
+				if (!options.healthCheckPath.empty() && !drainRequested && UpstreamPool::Clock::now() >= nextHealthCheck) {
+					startHealthChecks();
+					nextHealthCheck = UpstreamPool::Clock::now() + std::chrono::seconds(options.healthCheckInterval);
+				}
+				{
+					std::unique_lock<std::mutex> lock(queueMutex);
+					if (transfers.empty()) {
+						auto wakeUp = [this]() { return !queue.empty() || stopRequested || drainRequested; };
+						if (options.healthCheckPath.empty()) {
+							queueNonEmpty.wait(lock, wakeUp);
+						}
+						else {
+							queueNonEmpty.wait_until(lock, nextHealthCheck, wakeUp);
+						}
+					}
+					if (stopRequested) { break; }
+					while (!drainRequested && !queue.empty() && transfers.size() + messages.size() < maxTransfers) {
+						messages.push_back(queue.pop());
+					}
+				}
+				for (const auto& message : messages) {
+					startTransfers(message);
+				}
+				messages.clear();
+
+				int running;
+				curl_multi_perform(multi, &running);
+				finishTransfers();
+				if (!transfers.empty()) {
+					curl_multi_poll(multi, NULL, 0, 1000, NULL);
+				}
+			}
+			for (const auto& transfer : transfers) {
+				curl_multi_remove_handle(multi, transfer.first);
+			}
+			transfers.clear();
+		}
+
+		void startTransfers(const SMTPMessage& message) {
+			for (auto& request : encoder.encode(message)) {
+				const Route& route = *request.route;
+				std::unique_ptr<Transfer> transfer(new Transfer(route, upstreams[route.index]->select()));
+				transfer->body = std::move(request.body);
+				transfer->form = std::move(request.form);
+				startTransfer(std::move(transfer));
+			}
+		}
+
+		void startTransfer(std::unique_ptr<Transfer> transfer) {
+			RequestBody& body = transfer->body;
+			CURL* curl = transfer->curl;
+			body.rewind();
+
+			struct curl_slist*& slist = transfer->headers; 
+			if (transfer->form.empty()) {
+				slist = curl_slist_append(slist, "Content-Type: application/json"); 
+			}
+			for (const auto& header : headers) {
+				slist = curl_slist_append(slist, header.c_str());
+			}
+			for (const auto& header : transfer->route.headers) {
+				slist = curl_slist_append(slist, header.c_str());
+			}
+			if (!transfer->form.empty()) {
+				// Not compressed: the parts are streamed as they are
+				transfer->mime = curl_mime_init(curl);
+				for (const auto& part : transfer->form) {
+					curl_mimepart* mimePart = curl_mime_addpart(transfer->mime);
+					curl_mime_name(mimePart, part.name.c_str());
+					if (!part.filename.empty()) {
+						curl_mime_filename(mimePart, part.filename.c_str());
+					}
+					curl_mime_type(mimePart, part.contentType.c_str());
+					curl_mime_data_cb(mimePart, static_cast<curl_off_t>(part.size()), curlFormReadCallback, curlFormSeekCallback, curlFormFreeCallback, new FormPartReader(part));
+				}
+				curl_easy_setopt(curl, CURLOPT_MIMEPOST, transfer->mime);
+			}
+			else {
+				try {
+					transfer->compressor = BodyCompressor::create(compression, body);
+				}
+				catch (const std::exception& e) {
+					LOG(warning) << "Posting uncompressed to " << transfer->upstream.url << ": unable to compress: " << e.what();
+				}
+				if (transfer->compressor) {
+					slist = curl_slist_append(slist, (std::string("Content-Encoding: ") + transfer->compressor->getContentEncoding()).c_str());
+					curl_easy_setopt(curl, CURLOPT_READFUNCTION, curlCompressedReadCallback);
+					curl_easy_setopt(curl, CURLOPT_READDATA, transfer->compressor.get());
+					curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, curlCompressedSeekCallback);
+					curl_easy_setopt(curl, CURLOPT_SEEKDATA, transfer->compressor.get());
+				}
+				else {
+					curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(body.size()));
+					curl_easy_setopt(curl, CURLOPT_READFUNCTION, curlBodyReadCallback);
+					curl_easy_setopt(curl, CURLOPT_READDATA, &body);
+					curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, curlBodySeekCallback);
+					curl_easy_setopt(curl, CURLOPT_SEEKDATA, &body);
+				}
+			}
+			slist = curl_slist_append(slist, "Expect:");
+			if (transfer->form.empty()) {
+				curl_easy_setopt(curl, CURLOPT_POST, 1);
+			}
+			curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist); 
+			curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+			curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5);
+			const std::string& url = transfer->upstream.url;
+			addTransfer(std::move(transfer), url);
+		}
+
+		void startHealthChecks() {
+			for (const auto& route : routes) {
+				for (auto& upstream : upstreams[route.index]->getUpstreams()) {
+					if (upstream.probing) {
+						continue;
+					}
+					upstream.probing = true;
+					std::unique_ptr<Transfer> transfer(new Transfer(route, upstream));
+					transfer->healthCheck = true;
+					curl_easy_setopt(transfer->curl, CURLOPT_TIMEOUT, static_cast<long>(options.healthCheckInterval));
+					addTransfer(std::move(transfer), upstream.healthCheckURL);
+				}
+			}
+		}
+
+		void addTransfer(std::unique_ptr<Transfer> transfer, const std::string& url) {
+			CURL* curl = transfer->curl;
+			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlWriteCallback);
+			if (traceEnabled) {
+				curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, curlDebugCallback);
+				curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
+			}
+			if (options.http2) {
+				bool tls = boost::algorithm::istarts_with(url, "https:");
+				curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, tls ? CURL_HTTP_VERSION_2TLS : CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+			}
+			curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1);
+			curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+			if (!options.unixSocket.empty()) {
+				curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, options.unixSocket.c_str());
+			}
+
+			curl_multi_add_handle(multi, curl);
+			if (!transfer->healthCheck) {
+				++transfer->upstream.outstanding;
+			}
+			transfers[curl] = std::move(transfer);
+		}
+
+		void finishTransfers() {
+			CURLMsg* msg;
+			int remaining;
+			while ((msg = curl_multi_info_read(multi, &remaining))) {
+				if (msg->msg != CURLMSG_DONE) {
+					continue;
+				}
+				CURL* curl = msg->easy_handle;
+				auto result = msg->data.result;
+				curl_multi_remove_handle(multi, curl);
+				auto i = transfers.find(curl);
+				std::unique_ptr<Transfer> transfer = std::move(i->second);
+				transfers.erase(i);
+
+				long statusCode = 0;
+				curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &statusCode);
+				auto& upstream = transfer->upstream;
+				auto& pool = *upstreams[transfer->route.index];
+				if (transfer->healthCheck) {
+					upstream.probing = false;
+					pool.reportHealthCheck(upstream, result == CURLE_OK && statusCode >= 200 && statusCode < 300);
+					continue;
+				}
+
+				--upstream.outstanding;
+				if (result != CURLE_OK) {
+					LOG(error) << "ERROR " << upstream.url << ": " << curl_easy_strerror(result) << std::endl;
+				}
+				else if (statusCode != 200) {
+					LOG(error) << "Error: Unexpected status code from " << upstream.url << ": " << statusCode;
+				}
+				double totalTime = 0;
+				curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &totalTime);
+				bool failed = result != CURLE_OK || statusCode >= 500;
+				pool.reportResult(upstream, !failed, totalTime);
+
+				// Retry on another upstream
+				auto tried = std::move(transfer->tried);
+				tried.push_back(&upstream);
+				if (failed && tried.size() < pool.size() && !stopRequested) {
+					std::unique_ptr<Transfer> retry(new Transfer(transfer->route, pool.select(tried)));
+					retry->body = std::move(transfer->body);
+					retry->form = std::move(transfer->form);
+					retry->tried = std::move(tried);
+					LOG(info) << "Retrying message on " << retry->upstream.url;
+					startTransfer(std::move(retry));
+				}
+			}
+		}
+
+	private:
+		const std::vector<Route>& routes;
+		const PriorityLanes& lanes;
+		RequestEncoder encoder;
+		std::vector<std::unique_ptr<UpstreamPool>> upstreams; // Indexed by route
+		std::vector<std::string> headers;
+		CompressionOptions compression;
+		HTTPOptions options;
+		size_t maxTransfers;
+		CURLM* multi;
+		std::map<CURL*, std::unique_ptr<Transfer>> transfers;
+		std::atomic_bool stopRequested;
+		std::atomic_bool drainRequested;
+		std::thread* thread;
+		FairQueue queue;
+		std::mutex queueMutex;
+		std::condition_variable queueNonEmpty;
+};
+
+// An HTTP/1.1 response, parsed as it comes in. The body is skipped.
+class HTTPResponseParser {
+	public:
+		HTTPResponseParser() {
+			reset();
+		}
+
+		void reset() {
+			state = StatusLine;
+			line.clear();
+			status = 0;
+			keepAlive = true;
+			chunked = false;
+			contentLength = boost::none;
+			remaining = 0;
+			started = false;
+		}
+
+		// Throws if the response is malformed.
+		void parse(const char* data, size_t size) {
+			started = started || size > 0;
+			const char* end = data + size;
+			while (data < end && state != Complete) {
+				if (state == Body || state == ChunkData) {
+					size_t length = std::min<size_t>(remaining, end - data);
+					data += length;
+					remaining -= length;
+					if (remaining == 0) {
+						state = state == Body ? Complete : ChunkDataEnd;
+					}
+				}
+				else if (state == UntilClose) {
+					data = end;
+				}
+				else {
+					const char* newline = std::find(data, end, '\n');
+					line.append(data, newline);
+					if (line.size() > 8192) {
+						throw std::runtime_error("Response line too long");
+					}
+					if (newline == end) {
+						data = end;
+						break;
+					}
+					data = newline + 1;
+					if (!line.empty() && line.back() == '\r') {
+						line.pop_back();
+					}
+					parseLine(line);
+					line.clear();
+				}
+			}
+			if (data < end) {
+				// Data after the response; don't reuse the connection
+				keepAlive = false;
+			}
+		}
+
+		// Returns true if the response ends when the connection is closed.
+		bool finishAtEOF() {
+			if (state == UntilClose) {
+				state = Complete;
+				return true;
+			}
+			return false;
+		}
+
+		bool isComplete() const {
+			return state == Complete;
+		}
+
+		bool hasStarted() const {
+			return started;
+		}
+
+		int getStatus() const {
+			return status;
+		}
+
+		bool isKeepAlive() const {
+			return keepAlive;
+		}
+
+	private:
+		enum State { StatusLine, Headers, Body, UntilClose, ChunkSize, ChunkData, ChunkDataEnd, Trailers, Complete };
+
+		void parseLine(const std::string& line) {
+			switch (state) {
+				case StatusLine: {
+					if (!boost::algorithm::starts_with(line, "HTTP/1.") || line.size() < 12) {
+						throw std::runtime_error("Invalid status line: " + line);
+					}
+					keepAlive = line[7] != '0';
+					status = std::atoi(line.c_str() + 9);
+					state = Headers;
+					break;
+				}
+				case Headers: {
+					if (!line.empty()) {
+						parseHeader(line);
+					}
+					else if (status >= 100 && status < 200) {
+						reset();
+						started = true;
+					}
+					else if (status == 204 || status == 304) {
+						state = Complete;
+					}
+					else if (chunked) {
+						state = ChunkSize;
+					}
+					else if (contentLength) {
+						remaining = *contentLength;
+						state = remaining > 0 ? Body : Complete;
+					}
+					else {
+						keepAlive = false;
+						state = UntilClose;
+					}
+					break;
+				}
+				case ChunkSize: {
+					char* end;
+					remaining = std::strtoul(line.c_str(), &end, 16);
+					if (end == line.c_str()) {
+						throw std::runtime_error("Invalid chunk size: " + line);
+					}
+					state = remaining > 0 ? ChunkData : Trailers;
+					break;
+				}
+				case ChunkDataEnd:
+					state = ChunkSize;
+					break;
+				case Trailers:
+					if (line.empty()) {
+						state = Complete;
+					}
+					break;
+				default:
+					break;
+			}
+		}
+
+		void parseHeader(const std::string& line) {
+			auto colon = line.find(':');
+			if (colon == std::string::npos) {
+				throw std::runtime_error("Invalid header: " + line);
+			}
+			std::string name = line.substr(0, colon);
+			std::string value = boost::algorithm::trim_copy(line.substr(colon + 1));
+			if (boost::algorithm::iequals(name, "Content-Length")) {
+				contentLength = std::strtoull(value.c_str(), NULL, 10);
+			}
+			else if (boost::algorithm::iequals(name, "Transfer-Encoding")) {
+				chunked = boost::algorithm::icontains(value, "chunked");
+			}
+			else if (boost::algorithm::iequals(name, "Connection")) {
+				if (boost::algorithm::icontains(value, "close")) {
+					keepAlive = false;
+				}
+				else if (boost::algorithm::icontains(value, "keep-alive")) {
+					keepAlive = true;
+				}
+			}
+		}
+
+		State state;
+		std::string line;
+		int status;
+		bool keepAlive;
+		bool chunked;
+		boost::optional<size_t> contentLength;
+		size_t remaining;
+		bool started;
+};
+
+// Posts messages from the event loop of the SMTP server, with a minimal 
+// HTTP/1.1 client. Messages don't have to change threads, and there is no 
+// extra thread to wake up for every message.
+// Connections are kept alive and reused, with at most --http-max-connections 
+// per URL. Request bodies are written with scatter-gather I/O straight from 
+// the (shared) encoded message data. Compressed bodies are compressed a 
+// chunk at a time as the socket takes them (and sent with chunked transfer 
+// encoding), and spilled files are read a chunk at a time; both happen on a 
+// separate thread, so large messages don't hold up the event loop.
+// Only http URLs are supported, and redirects are not followed.
+class AsioHTTPPoster : public MessageSink {
+	public:
+		AsioHTTPPoster(boost::asio::io_service& ioService, const RoutingTable& routingTable, const PriorityLanes& lanes, const std::vector<std::string>& headers, const CompressionOptions& compression, const HTTPOptions& options) : 
+				ioService(ioService),
+				routes(routingTable.getRoutes()),
+				lanes(lanes),
+				encoder(routingTable.getRoutes(), options),
+				headers(headers),
+				compression(compression),
+				options(options),
+				resolver(ioService),
+				healthCheckTimer(ioService),
+				queue(lanes.getLanes()),
+				requests(0),
+				draining(false),
+				stopped(false),
+				bodyThread(1) {
+			if (options.http2) {
+				throw std::runtime_error("HTTP/2 is not supported by the asio HTTP engine");
+			}
+			size_t upstreamCount = 0;
+			for (const auto& route : routingTable.getRoutes()) {
+				upstreams.emplace_back(new UpstreamPool(route.urls, options));
+				for (auto& upstream : upstreams.back()->getUpstreams()) {
+					hosts[&upstream].reset(new Host(upstream));
+				}
+				upstreamCount += route.urls.size();
+			}
+			maxRequests = upstreamCount * std::max<long>(1, options.maxConnections);
+			if (!options.healthCheckPath.empty()) {
+				scheduleHealthChecks(std::chrono::seconds(0));
+			}
+		}
+
+		virtual void handle(const SMTPMessage& message) override {
+			queue.push(message, lanes.classify(message));
+			pump();
+		}
+
+		virtual void drain(DrainHandler handler) override {
+			draining = true;
+			drainHandler = handler;
+			checkDrained();
+		}
+
+		virtual void stop() override {
+			stopped = true;
+			healthCheckTimer.cancel();
+			for (auto& host : hosts) {
+				host.second->idle.clear();
+			}
+		}
+
+	private:
+		typedef UpstreamPool::Upstream Upstream;
+		typedef UpstreamPool::Clock Clock;
+
+		struct URL {
+			std::string host;
+			std::string port;
+			std::string hostHeader;
+			std::string target;
+			std::string authorization;
+		};
+
+		struct Connection {
+			Connection(boost::asio::io_service& ioService) : socket(ioService), reused(false) {}
+
+			generic::stream_protocol::socket socket; // TCP or Unix
+			std::array<char, 4096> buffer;
+			HTTPResponseParser response;
+			bool reused;
+		};
+
+		// A part of a request: a piece of memory, or a file or compressed body 
+		// to stream
+		struct Piece {
+			std::shared_ptr<const std::string> data;
+			std::shared_ptr<const SpillFile> file;
+			std::shared_ptr<BodyCompressor> compressor; // Written as chunks
+		};
+
+		enum { ChunkSize = 65536 };
+
+		struct Request {
+			Request(const Route& route, Upstream& upstream) : route(route), upstream(upstream), healthCheck(false), piece(0), fileOffset(0) {}
+
+			const Route& route;
+			Upstream& upstream;
+			RequestBody body;
+			std::vector<FormPart> form; // If not empty, posted instead of the (JSON) body
+			std::vector<const Upstream*> tried; // Upstreams that failed before this one
+			bool healthCheck;
+			Clock::time_point started;
+			std::vector<Piece> pieces; // Head and body
+			size_t piece; // Next piece to write
+			size_t fileOffset;
+			std::string chunk; // Of a streamed piece
+			std::string chunkHead;
+			std::shared_ptr<Connection> connection;
+			std::unique_ptr<boost::asio::steady_timer> timeout;
+		};
+
+		// The connections to an upstream
+		struct Host {
+			Host(const Upstream& upstream) : url(parseURL(upstream.url)), connections(0) {
+				if (!upstream.healthCheckURL.empty()) {
+					healthCheckTarget = parseURL(upstream.healthCheckURL).target;
+				}
+			}
+
+			URL url;
+			std::string healthCheckTarget;
+			std::vector<generic::stream_protocol::endpoint> endpoints; // Resolved when first connecting
+			std::vector<std::shared_ptr<Connection>> idle;
+			size_t connections; // Open or opening
+			std::deque<std::shared_ptr<Request>> waiting; // For a connection
+		};
+
+		static URL parseURL(const std::string& url) {
+			std::shared_ptr<CURLU> curlURL(curl_url(), curl_url_cleanup);
+			if (curl_url_set(curlURL.get(), CURLUPART_URL, url.c_str(), 0) != CURLUE_OK) {
+				throw std::runtime_error("Invalid URL: " + url);
+			}
+			auto get = [&curlURL](CURLUPart part, unsigned int flags) {
+				std::string result;
+				char* value = NULL;
+				if (curl_url_get(curlURL.get(), part, &value, flags) == CURLUE_OK) {
+					result = value;
+					curl_free(value);
+				}
+				return result;
+			};
+			if (!boost::algorithm::iequals(get(CURLUPART_SCHEME, 0), "http")) {
+				throw std::runtime_error("Only http URLs are supported by the asio HTTP engine: " + url);
+			}
+			URL result;
+			result.host = get(CURLUPART_HOST, 0);
+			result.hostHeader = result.host;
+			auto port = get(CURLUPART_PORT, 0);
+			if (!port.empty()) {
+				result.hostHeader += ":" + port;
+			}
+			result.port = get(CURLUPART_PORT, CURLU_DEFAULT_PORT);
+			if (result.host.size() > 2 && result.host.front() == '[') {
+				result.host = result.host.substr(1, result.host.size() - 2);
+			}
+			result.target = get(CURLUPART_PATH, 0);
+			auto query = get(CURLUPART_QUERY, 0);
+			if (!query.empty()) {
+				result.target += "?" + query;
+			}
+			auto user = get(CURLUPART_USER, CURLU_URLDECODE);
+			if (!user.empty()) {
+				result.authorization = "Basic " + encodeBase64(user + ":" + get(CURLUPART_PASSWORD, CURLU_URLDECODE));
+			}
+			return result;
+		}
+
+		void pump() {
+			while (!draining && !stopped && !queue.empty() && requests < maxRequests) {
+				SMTPMessage message = queue.pop();
+				for (auto& encoded : encoder.encode(message)) {
+					const Route& route = *encoded.route;
+					auto request = std::make_shared<Request>(route, upstreams[route.index]->select());
+					request->body = std::move(encoded.body);
+					request->form = std::move(encoded.form);
+					start(request);
+				}
+			}
+		}
+
+		void checkDrained() {
+			if (!draining || requests > 0 || !drainHandler) {
+				return;
+			}
+			std::vector<SMTPMessage> messages;
+			while (!queue.empty()) {
+				messages.push_back(queue.pop());
+			}
+			auto handler = std::move(drainHandler);
+			drainHandler = nullptr;
+			handler(std::move(messages));
+		}
+
+		void scheduleHealthChecks(std::chrono::seconds delay) {
+			healthCheckTimer.expires_from_now(delay);
+			healthCheckTimer.async_wait([this](const boost::system::error_code& ec) {
+				if (ec || stopped) {
+					return;
+				}
+				if (!draining) {
+					startHealthChecks();
+				}
+				scheduleHealthChecks(std::chrono::seconds(options.healthCheckInterval));
+			});
+		}
+
+		void startHealthChecks() {
+			for (const auto& route : routes) {
+				for (auto& upstream : upstreams[route.index]->getUpstreams()) {
+					if (upstream.probing) {
+						continue;
+					}
+					upstream.probing = true;
+					auto request = std::make_shared<Request>(route, upstream);
+					request->healthCheck = true;
+					request->timeout.reset(new boost::asio::steady_timer(ioService));
+					request->timeout->expires_from_now(std::chrono::seconds(options.healthCheckInterval));
+					request->timeout->async_wait([request](const boost::system::error_code& ec) {
+						if (!ec && request->connection) {
+							boost::system::error_code ignored;
+							request->connection->socket.close(ignored);
+						}
+					});
+					start(request);
+				}
+			}
+		}
+
+		void start(std::shared_ptr<Request> request) {
+			if (!request->healthCheck) {
+				++requests;
+				++request->upstream.outstanding;
+			}
+			request->started = Clock::now();
+			Host& host = *hosts[&request->upstream];
+			try {
+				createPieces(host, *request);
+			}
+			catch (const std::exception& e) {
+				finish(request, 0, e.what());
+				return;
+			}
+			send(host, request);
+		}
+
+		// Lays out the request head and body as a list of pieces to write
+		void createPieces(const Host& host, Request& request) {
+			std::vector<Piece> body;
+			std::string head = (request.healthCheck ? "GET " + host.healthCheckTarget : "POST " + host.url.target) + " HTTP/1.1\r\n";
+			head += "Host: " + host.url.hostHeader + "\r\n";
+			if (!host.url.authorization.empty()) {
+				head += "Authorization: " + host.url.authorization + "\r\n";
+			}
+			if (!request.healthCheck) {
+				size_t contentLength = 0;
+				if (!request.form.empty()) {
+					// Not compressed: the parts are streamed as they are
+					std::string boundary = createBoundary();
+					head += "Content-Type: multipart/form-data; boundary=" + boundary + "\r\n";
+					for (const auto& part : request.form) {
+						std::string partHead = "--" + boundary + "\r\nContent-Disposition: form-data; name=\"" + escapeFormValue(part.name) + "\"";
+						if (!part.filename.empty()) {
+							partHead += "; filename=\"" + escapeFormValue(part.filename) + "\"";
+						}
+						partHead += "\r\nContent-Type: " + part.contentType + "\r\n\r\n";
+						contentLength += partHead.size() + part.size() + 2;
+						body.push_back({std::make_shared<const std::string>(std::move(partHead)), nullptr, nullptr});
+						body.push_back({part.data, part.file, nullptr});
+						body.push_back({crlf, nullptr, nullptr});
+					}
+					auto end = std::make_shared<const std::string>("--" + boundary + "--\r\n");
+					contentLength += end->size();
+					body.push_back({end, nullptr, nullptr});
+				}
+				else {
+					head += "Content-Type: application/json\r\n";
+					request.body.rewind();
+					std::shared_ptr<BodyCompressor> compressor;
+					try {
+						compressor = BodyCompressor::create(compression, request.body);
+					}
+					catch (const std::exception& e) {
+						LOG(warning) << "Posting uncompressed to " << request.upstream.url << ": unable to compress: " << e.what();
+					}
+					if (compressor) {
+						head += std::string("Content-Encoding: ") + compressor->getContentEncoding() + "\r\n";
+						head += "Transfer-Encoding: chunked\r\n";
+						body.push_back({nullptr, nullptr, compressor});
+					}
+					else {
+						contentLength = request.body.size();
+						for (const auto& segment : request.body.getSegments()) {
+							body.push_back({segment, nullptr, nullptr});
+						}
+					}
+				}
+				if (body.empty() || !body.back().compressor) {
+					head += "Content-Length: " + std::to_string(contentLength) + "\r\n";
+				}
+			}
+			for (const auto& header : headers) {
+				head += header + "\r\n";
+			}
+			for (const auto& header : request.route.headers) {
+				head += header + "\r\n";
+			}
+			head += "\r\n";
+			TRACE << "HTTP: -> H: " << LogPayload(head);
+
+			request.pieces.clear();
+			request.pieces.push_back({std::make_shared<const std::string>(std::move(head)), nullptr, nullptr});
+			request.pieces.insert(request.pieces.end(), body.begin(), body.end());
+			request.piece = 0;
+			request.fileOffset = 0;
+		}
+
+		static std::string createBoundary() {
+			static std::mt19937_64 random(std::random_device{}());
+			std::ostringstream boundary;
+			boundary << "------------------------" << std::hex << std::setfill('0') << std::setw(16) << random();
+			return boundary.str();
+		}
+
+		static std::string escapeFormValue(const std::string& value) {
+			std::string result;
+			for (char c : value) {
+				switch (c) {
+					case '"': result += "%22"; break;
+					case '\r': result += "%0D"; break;
+					case '\n': result += "%0A"; break;
+					default: result += c;
+				}
+			}
+			return result;
+		}
+
+		// Sends the request on an idle connection, or a new one if there is 
+		// room; otherwise, it waits for a connection.
+		void send(Host& host, std::shared_ptr<Request> request) {
+			if (!host.idle.empty()) {
+				auto connection = std::move(host.idle.back());
+				host.idle.pop_back();
+				connection->reused = true;
+				write(host, connection, request);
+			}
+			else if (host.connections < static_cast<size_t>(std::max<long>(1, options.maxConnections))) {
+				++host.connections;
+				connect(host, request);
+			}
+			else {
+				host.waiting.push_back(request);
+			}
+		}
+
+		// Gives the connection (or, if it was closed, its slot) to the next 
+		// waiting request.
+		void release(Host& host, std::shared_ptr<Connection> connection) {
+			if (!connection) {
+				--host.connections;
+			}
+			else if (stopped) {
+				return;
+			}
+			else {
+				host.idle.push_back(connection);
+			}
+			if (!host.waiting.empty()) {
+				auto request = host.waiting.front();
+				host.waiting.pop_front();
+				send(host, request);
+			}
+		}
+
+		void connect(Host& host, std::shared_ptr<Request> request) {
+			if (host.endpoints.empty() && !options.unixSocket.empty()) {
+				host.endpoints.push_back(local::stream_protocol::endpoint(options.unixSocket));
+			}
+			else if (host.endpoints.empty()) {
+				resolver.async_resolve(host.url.host, host.url.port, [this, &host, request](const boost::system::error_code& ec, tcp::resolver::results_type results) {
+					if (ec || results.empty()) {
+						release(host, nullptr);
+						finish(request, 0, "Unable to resolve " + host.url.host + ": " + ec.message());
+						return;
+					}
+					for (const auto& result : results) {
+						host.endpoints.push_back(result.endpoint());
+					}
+					connect(host, request);
+				});
+				return;
+			}
+			auto connection = std::make_shared<Connection>(ioService);
+			request->connection = connection;
+			boost::asio::async_connect(connection->socket, host.endpoints, [this, &host, connection, request](const boost::system::error_code& ec, const generic::stream_protocol::endpoint&) {
+				if (ec) {
+					// Resolve again on the next connection
+					host.endpoints.clear();
+					release(host, nullptr);
+					finish(request, 0, ec.message());
+					return;
+				}
+				if (options.unixSocket.empty()) {
+					// Failing this only leaves Nagle on; a broken connection fails the write
+					boost::system::error_code ignored;
+					connection->socket.set_option(tcp::no_delay(true), ignored);
+				}
+				write(host, connection, request);
+			});
+		}
+
+		void write(Host& host, std::shared_ptr<Connection> connection, std::shared_ptr<Request> request) {
+			request->connection = connection;
+			request->piece = 0;
+			request->fileOffset = 0;
+			for (const auto& piece : request->pieces) {
+				if (piece.compressor) {
+					piece.compressor->rewind();
+				}
+			}
+			connection->response.reset();
+			writePieces(host, connection, request);
+		}
+
+		// Writes consecutive pieces in memory with a single (gathering) write. 
+		// Files and compressed bodies are written a chunk at a time, each 
+		// chunk being read (or compressed) on the body thread while the event 
+		// loop goes on.
+		void writePieces(Host& host, std::shared_ptr<Connection> connection, std::shared_ptr<Request> request) {
+			auto& pieces = request->pieces;
+			std::vector<boost::asio::const_buffer> buffers;
+			while (request->piece < pieces.size() && !pieces[request->piece].file && !pieces[request->piece].compressor) {
+				buffers.push_back(boost::asio::buffer(*pieces[request->piece].data));
+				++request->piece;
+			}
+			if (!buffers.empty()) {
+				writeBuffers(host, connection, request, buffers);
+			}
+			else if (request->piece == pieces.size()) {
+				read(host, connection, request);
+			}
+			else {
+				bool chunked = !!pieces[request->piece].compressor;
+				boost::asio::post(bodyThread, [this, &host, connection, request, chunked]() {
+					std::string error;
+					try {
+						readChunk(*request);
+					}
+					catch (const std::exception& e) {
+						error = e.what();
+					}
+					ioService.post([this, &host, connection, request, chunked, error]() {
+						if (!error.empty()) {
+							fail(host, connection, request, error);
+							return;
+						}
+						std::vector<boost::asio::const_buffer> buffers;
+						if (!chunked) {
+							buffers.push_back(boost::asio::buffer(request->chunk));
+						}
+						else if (!request->chunk.empty()) {
+							std::ostringstream head;
+							head << std::hex << request->chunk.size() << "\r\n";
+							request->chunkHead = head.str();
+							buffers.push_back(boost::asio::buffer(request->chunkHead));
+							buffers.push_back(boost::asio::buffer(request->chunk));
+							buffers.push_back(boost::asio::buffer(*crlf));
+						}
+						else {
+							buffers.push_back(boost::asio::buffer(*lastChunk));
+						}
+						writeBuffers(host, connection, request, buffers);
+					});
+				});
+			}
+		}
+
+		void writeBuffers(Host& host, std::shared_ptr<Connection> connection, std::shared_ptr<Request> request, const std::vector<boost::asio::const_buffer>& buffers) {
+			boost::asio::async_write(connection->socket, buffers, [this, &host, connection, request](const boost::system::error_code& ec, size_t) {
+				if (ec) {
+					fail(host, connection, request, ec.message());
+					return;
+				}
+				writePieces(host, connection, request);
+			});
+		}
+
+		// Runs on the body thread: reads the next chunk of the current piece 
+		// into the chunk buffer (empty at the end of a compressed body), and 
+		// moves on to the next piece after the last chunk.
+		static void readChunk(Request& request) {
+			const Piece& piece = request.pieces[request.piece];
+			request.chunk.resize(ChunkSize);
+			if (piece.compressor) {
+				size_t size = piece.compressor->read(&request.chunk[0], request.chunk.size());
+				request.chunk.resize(size);
+				if (size == 0) {
+					++request.piece;
+				}
+				return;
+			}
+			const SpillFile& file = *piece.file;
+			size_t length = std::min(request.chunk.size(), file.getSize() - request.fileOffset);
+			ssize_t size = length > 0 ? file.read(request.fileOffset, &request.chunk[0], length) : 0;
+			if (size < 0 || (length > 0 && size == 0)) {
+				throw std::runtime_error(std::string("Unable to read temporary file: ") + (size < 0 ? strerror(errno) : "unexpected end of file"));
+			}
+			request.chunk.resize(size);
+			request.fileOffset += size;
+			if (request.fileOffset == file.getSize()) {
+				++request.piece;
+				request.fileOffset = 0;
+			}
+		}
+
+		void read(Host& host, std::shared_ptr<Connection> connection, std::shared_ptr<Request> request) {
+			connection->socket.async_read_some(boost::asio::buffer(connection->buffer), [this, &host, connection, request](const boost::system::error_code& ec, size_t size) {
+				auto& response = connection->response;
+				if (ec == boost::asio::error::eof && response.finishAtEOF()) {
+					complete(host, connection, request);
+					return;
+				}
+				if (ec) {
+					fail(host, connection, request, ec == boost::asio::error::eof ? "Connection closed by server" : ec.message());
+					return;
+				}
+				TRACE << "HTTP: <- " << LogPayload(connection->buffer.data(), size);
+				try {
+					response.parse(connection->buffer.data(), size);
+				}
+				catch (const std::exception& e) {
+					fail(host, connection, request, e.what());
+					return;
+				}
+				if (response.isComplete()) {
+					complete(host, connection, request);
+				}
+				else {
+					read(host, connection, request);
+				}
+			});
+		}
+
+		void complete(Host& host, std::shared_ptr<Connection> connection, std::shared_ptr<Request> request) {
+			request->connection.reset();
+			int status = connection->response.getStatus();
+			if (connection->response.isKeepAlive()) {
+				release(host, connection);
+			}
+			else {
+				boost::system::error_code ignored;
+				connection->socket.close(ignored);
+				release(host, nullptr);
+			}
+			finish(request, status, std::string());
+		}
+
+		void fail(Host& host, std::shared_ptr<Connection> connection, std::shared_ptr<Request> request, const std::string& error) {
+			request->connection.reset();
+			boost::system::error_code ignored;
+			connection->socket.close(ignored);
+			bool retry = connection->reused && !connection->response.hasStarted() && !stopped;
+			release(host, nullptr);
+			if (retry) {
+				// The server closed the idle connection before it got the request
+				TRACE << "HTTP: Connection to " << request->upstream.url << " was closed; reconnecting";
+				send(host, request);
+				return;
+			}
+			finish(request, 0, error);
+		}
+
+		void finish(std::shared_ptr<Request> request, int statusCode, const std::string& error) {
+			auto& upstream = request->upstream;
+			auto& pool = *upstreams[request->route.index];
+			if (request->healthCheck) {
+				request->timeout->cancel();
+				upstream.probing = false;
+				pool.reportHealthCheck(upstream, error.empty() && statusCode >= 200 && statusCode < 300);
+				return;
+			}
+
+			--requests;
+			--upstream.outstanding;
+			if (!error.empty()) {
+				LOG(error) << "ERROR " << upstream.url << ": " << error;
+			}
+			else if (statusCode != 200) {
+				LOG(error) << "Error: Unexpected status code from " << upstream.url << ": " << statusCode;
+			}
+			bool failed = !error.empty() || statusCode >= 500;
+			pool.reportResult(upstream, !failed, std::chrono::duration<double>(Clock::now() - request->started).count());
+
+			// Retry on another upstream
+			auto tried = std::move(request->tried);
+			tried.push_back(&upstream);
+			if (failed && tried.size() < pool.size() && !stopped) {
+				auto retry = std::make_shared<Request>(request->route, pool.select(tried));
+				retry->body = std::move(request->body);
+				retry->form = std::move(request->form);
+				retry->tried = std::move(tried);
+				LOG(info) << "Retrying message on " << retry->upstream.url;
+				start(retry);
+			}
+			pump();
+			checkDrained();
+		}
+
+		static const std::shared_ptr<const std::string> crlf;
+		static const std::shared_ptr<const std::string> lastChunk;
+
+		boost::asio::io_service& ioService;
+		const std::vector<Route>& routes;
+		const PriorityLanes& lanes;
+		RequestEncoder encoder;
+		std::vector<std::unique_ptr<UpstreamPool>> upstreams; // Indexed by route
+		std::map<const Upstream*, std::unique_ptr<Host>> hosts;
+		std::vector<std::string> headers;
+		CompressionOptions compression;
+		HTTPOptions options;
+		tcp::resolver resolver;
+		boost::asio::steady_timer healthCheckTimer;
+		FairQueue queue;
+		size_t maxRequests;
+		size_t requests; // In flight, excluding health checks
+		bool draining;
+		bool stopped;
+		DrainHandler drainHandler;
+		boost::asio::thread_pool bodyThread; // Last, so it is joined first
+};
+
+const std::shared_ptr<const std::string> AsioHTTPPoster::crlf = std::make_shared<const std::string>("\r\n");
+const std::shared_ptr<const std::string> AsioHTTPPoster::lastChunk = std::make_shared<const std::string>("0\r\n\r\n");
+
+struct FileSinkOptions {
+	enum Sync { Never, Batch, Interval };
+
+	FileSinkOptions() : sync(Never), syncInterval(1), maxSize(0), rotateSeconds(0) {}
+
+	std::string path;
+	Sync sync; // When to flush the file to disk
+	int syncInterval; // Seconds, with Interval
+	size_t maxSize; // Rotate before the file grows beyond this (0 = never)
+	int rotateSeconds; // Rotate files this old (0 = never)
+};
+
+// Appends messages as JSON lines (NDJSON) to a file, from a separate thread.
+// The messages that come in while a batch is being written are written as 
+// the next batch, with a single writev, so the number of system calls goes 
+// down as the load goes up. 
+// Rotated files are renamed to <path>.<time>, and a new file is started.
+class FileSink : public MessageSink {
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+		FileSink(const FileSinkOptions& options) : options(options), fd(-1), size(0), dirty(false), stopRequested(false), drainRequested(false) {
+			open();
+			thread = new std::thread(std::bind(&FileSink::run, this));
+		}
+
+		~FileSink() {
+			stop();
+			if (fd >= 0) {
+				close(fd);
+			}
+		}
+
+		virtual void handle(const SMTPMessage& message) override {
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				queue.push_back(message);
+			}
+			queueNonEmpty.notify_one();
+		}
+
+		// Blocks the event loop until the queued messages have been written.
+		virtual void drain(DrainHandler handler) override {
+			drainRequested = true;
+			join();
+			std::vector<SMTPMessage> result;
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				result.assign(queue.begin(), queue.end());
+				queue.clear();
+			}
+			handler(std::move(result));
+		}
+
+		virtual void stop() override {
+			stopRequested = true;
+			join();
+		}
+
+	private:
+		void join() {
+			if (!thread) {
+				return;
+			}
+			queueNonEmpty.notify_one();
+			thread->join();
+			delete thread;
+			thread = 0;
+		}
+
+		void run() {
+			std::vector<SMTPMessage> batch;
+			Clock::time_point nextSync;
+			while (true) {
+				{
+					std::unique_lock<std::mutex> lock(queueMutex);
+					auto wakeUp = [this]() { return !queue.empty() || stopRequested || drainRequested; };
+					if (dirty) {
+						queueNonEmpty.wait_until(lock, nextSync, wakeUp);
+					}
+					else {
+						queueNonEmpty.wait(lock, wakeUp);
+					}
+					if (queue.empty() && (stopRequested || drainRequested)) {
+						break;
+					}
+					batch.assign(std::make_move_iterator(queue.begin()), std::make_move_iterator(queue.end()));
+					queue.clear();
+				}
+				if (!batch.empty() && !write(batch)) {
+					// Try again later (or leave the messages to the next process)
+					std::unique_lock<std::mutex> lock(queueMutex);
+					queue.insert(queue.begin(), std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()));
+					if (stopRequested || drainRequested) {
+						break;
+					}
+					queueNonEmpty.wait_for(lock, std::chrono::seconds(1), [this]() { return stopRequested || drainRequested; });
+				}
+				batch.clear();
+				if (options.sync == FileSinkOptions::Interval && !dirty && size > 0) {
+					dirty = true;
+					nextSync = Clock::now() + std::chrono::seconds(options.syncInterval);
+				}
+				if (dirty && Clock::now() >= nextSync) {
+					sync();
+				}
+			}
+			if (dirty) {
+				sync();
+			}
+		}
+
+		// Returns false if the batch was not written; the file is then left 
+		// as it was.
+		bool write(const std::vector<SMTPMessage>& batch) {
+			static const char newline = '\n';
+			if (fd < 0) {
+				try {
+					open();
+				}
+				catch (const std::exception& e) {
+					LOG(error) << e.what();
+					return false;
+				}
+			}
+			std::vector<RequestBody> lines;
+			size_t length = 0;
+			for (const auto& message : batch) {
+				try {
+					lines.push_back(RequestEncoder::encodeJSON(message));
+					length += lines.back().size() + 1;
+				}
+				catch (const std::exception& e) {
+					LOG(error) << "Dropping message: " << e.what();
+				}
+			}
+			if (size > 0 && ((options.maxSize > 0 && size + length > options.maxSize) || (options.rotateSeconds > 0 && Clock::now() - opened >= std::chrono::seconds(options.rotateSeconds)))) {
+				try {
+					rotate();
+				}
+				catch (const std::exception& e) {
+					LOG(error) << e.what();
+				}
+			}
+
+			std::vector<iovec> buffers;
+			for (const auto& line : lines) {
+				for (const auto& segment : line.getSegments()) {
+					buffers.push_back({const_cast<char*>(segment->data()), segment->size()});
+				}
+				buffers.push_back({const_cast<char*>(&newline), 1});
+			}
+			size_t index = 0;
+			size_t written = 0;
+			while (index < buffers.size()) {
+				ssize_t result = ::writev(fd, &buffers[index], std::min<size_t>(IOV_MAX, buffers.size() - index));
+				if (result < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					LOG(error) << "Unable to write to " << options.path << ": " << strerror(errno);
+					if (written > 0 && ftruncate(fd, size) < 0) {
+						LOG(error) << "Unable to truncate " << options.path << ": " << strerror(errno);
+					}
+					return false;
+				}
+				written += result;
+				// Skip what was written
+				size_t remaining = result;
+				while (index < buffers.size() && remaining >= buffers[index].iov_len) {
+					remaining -= buffers[index].iov_len;
+					++index;
+				}
+				if (remaining > 0) {
+					buffers[index].iov_base = static_cast<char*>(buffers[index].iov_base) + remaining;
+					buffers[index].iov_len -= remaining;
+				}
+			}
+			size += written;
+			if (options.sync == FileSinkOptions::Batch) {
+				sync();
+			}
+			TRACE << "Wrote " << lines.size() << " message(s) to " << options.path;
+			return true;
+		}
+
+		void sync() {
+			if (fdatasync(fd) < 0) {
+				LOG(error) << "Unable to sync " << options.path << ": " << strerror(errno);
+			}
+			dirty = false;
+		}
+
+		void open() {
+			fd = ::open(options.path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+			if (fd < 0) {
+				throw std::runtime_error("Unable to open " + options.path + ": " + strerror(errno));
+			}
+			struct stat info;
+			size = fstat(fd, &info) == 0 ? info.st_size : 0;
+			opened = Clock::now();
+		}
+
+		void rotate() {
+			char timestamp[32];
+			std::time_t now = std::time(nullptr);
+			std::strftime(timestamp, sizeof(timestamp), "%Y%m%dT%H%M%S", std::gmtime(&now));
+			std::string rotated = options.path + "." + timestamp;
+			struct stat info;
+			for (int i = 1; stat(rotated.c_str(), &info) == 0; ++i) {
+				rotated = options.path + "." + timestamp + "." + std::to_string(i);
+			}
+			if (options.sync != FileSinkOptions::Never) {
+				sync();
+			}
+			if (rename(options.path.c_str(), rotated.c_str()) < 0) {
+				throw std::runtime_error("Unable to rotate " + options.path + ": " + strerror(errno));
+			}
+			close(fd);
+			fd = -1;
+			open();
+			LOG(info) << "Rotated " << options.path << " to " << rotated;
+		}
+
+		FileSinkOptions options;
+		int fd;
+		size_t size;
+		Clock::time_point opened;
+		bool dirty; // Written but not synced (with Interval)
+		std::atomic_bool stopRequested;
+		std::atomic_bool drainRequested;
+		std::thread* thread;
+		std::deque<SMTPMessage> queue;
+		std::mutex queueMutex;
+		std::condition_variable queueNonEmpty;
+};
+
+// Publishes messages into a memory-mapped ring buffer file, for a consumer 
+// process on the same host (--sink=ring). Messages are published from the 
+// event loop, without system calls, unless the consumer is asleep.
+//
+// The file starts with a header page (see RingHeader), followed by the 
+// data area of 'capacity' bytes (a power of two). Positions count bytes 
+// since the ring was created; position p is at offset 
+// 4096 + (p & (capacity - 1)). Each record has a 16-byte header (32-bit 
+// length and type, 64-bit sequence number), followed by the message as 
+// JSON (as in the HTTP request body), padded to 16 bytes. When a record 
+// doesn't fit before the end of the data area, a padding record fills up 
+// the rest.
+// The producer stores writePosition after writing records; the consumer 
+// stores readPosition after reading them. A consumer that runs out of 
+// records loads the doorbell (a futex, bumped for every record), sets 
+// consumerWaiting, issues a full fence, checks writePosition again, and 
+// then waits on the doorbell with the value it loaded. The producer stores 
+// writePosition, bumps the doorbell, and issues a full fence before it 
+// loads consumerWaiting, so either the consumer sees the new writePosition 
+// or the producer sees the flag (and wakes it).
+// When the ring is full, messages are queued in memory until the consumer 
+// catches up. Only one process publishes at a time: a new process (e.g. 
+// on hot restart) queues its messages until the previous one is gone.
+class RingSink : public MessageSink {
+	public:
+		static const size_t HeaderSize = 4096;
+		static const uint32_t MessageRecord = 1;
+		static const uint32_t PaddingRecord = 2;
+
+		RingSink(boost::asio::io_service& ioService, const std::string& path, size_t capacity) : path(path), retryTimer(ioService), header(NULL), data(NULL), owner(false), retrying(false) {
+			if (capacity < 4096 || (capacity & (capacity - 1)) != 0) {
+				throw std::runtime_error("Ring buffer size must be a power of two of at least 4096 bytes");
+			}
+			int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+			if (fd < 0) {
+				throw std::runtime_error("Unable to open " + path + ": " + strerror(errno));
+			}
+			struct stat info;
+			bool created = fstat(fd, &info) == 0 && info.st_size == 0;
+			if (created && ftruncate(fd, HeaderSize + capacity) < 0) {
+				close(fd);
+				throw std::runtime_error("Unable to size " + path + ": " + strerror(errno));
+			}
+			if (!created && static_cast<size_t>(info.st_size) != HeaderSize + capacity) {
+				close(fd);
+				throw std::runtime_error("Ring buffer " + path + " exists with a different size");
+			}
+			mappingSize = HeaderSize + capacity;
+			void* mapping = mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			close(fd);
+			if (mapping == MAP_FAILED) {
+				throw std::runtime_error("Unable to map " + path + ": " + strerror(errno));
+			}
+			header = static_cast<RingHeader*>(mapping);
+			data = static_cast<char*>(mapping) + HeaderSize;
+			if (created) {
+				new (header) RingHeader();
+				header->capacity = capacity;
+				std::atomic_thread_fence(std::memory_order_release);
+				memcpy(header->magic, "SHPRING1", sizeof(header->magic));
+			}
+			else if (memcmp(header->magic, "SHPRING1", sizeof(header->magic)) != 0 || header->capacity != capacity) {
+				munmap(mapping, mappingSize);
+				throw std::runtime_error(path + " is not a ring buffer of this size");
+			}
+		}
+
+		~RingSink() {
+			release();
+			munmap(header, mappingSize);
+		}
+
+		virtual void handle(const SMTPMessage& message) override {
+			if (pending.empty() && acquire() && publish(message)) {
+				return;
+			}
+			if (pending.empty() && owner) {
+				LOG(warning) << "Ring buffer " << path << " is full; queueing messages";
+			}
+			pending.push_back(message);
+			scheduleRetry();
+		}
+
+		// Publishes what fits, and gives up the ring to the next process.
+		virtual void drain(DrainHandler handler) override {
+			publishPending();
+			release();
+			retryTimer.cancel();
+			std::vector<SMTPMessage> messages(pending.begin(), pending.end());
+			pending.clear();
+			handler(std::move(messages));
+		}
+
+		virtual void stop() override {
+			release();
+			retryTimer.cancel();
+		}
+
+	private:
+		struct RingHeader {
+			RingHeader() : capacity(0), writePosition(0), readPosition(0), doorbell(0), consumerWaiting(0), producer(0), nextSequence(0) {
+				memset(magic, 0, sizeof(magic));
+			}
+
+			char magic[8]; // Set last when created
+			uint64_t capacity;
+			alignas(64) std::atomic<uint64_t> writePosition; // Offset 64
+			alignas(64) std::atomic<uint64_t> readPosition; // Offset 128
+			alignas(64) std::atomic<uint32_t> doorbell; // Offset 192
+			std::atomic<uint32_t> consumerWaiting; // Offset 196
+			std::atomic<int32_t> producer; // Offset 200: PID, 0 = none
+			uint64_t nextSequence; // Offset 208
+		};
+
+		struct RecordHeader {
+			uint32_t length;
+			uint32_t type;
+			uint64_t sequence;
+		};
+
+		// Takes over the ring if no other (living) process publishes to it.
+		bool acquire() {
+			if (owner) {
+				return true;
+			}
+			int32_t current = header->producer.load();
+			if (current != 0 && current != getpid() && (kill(current, 0) == 0 || errno != ESRCH)) {
+				return false;
+			}
+			owner = header->producer.compare_exchange_strong(current, getpid());
+			if (owner) {
+				LOG(info) << "Publishing to ring buffer " << path;
+			}
+			return owner;
+		}
+
+		void release() {
+			if (owner) {
+				header->producer.store(0);
+				owner = false;
+			}
+		}
+
+		bool publish(const SMTPMessage& message) {
+			RequestBody body;
+			try {
+				body = RequestEncoder::encodeJSON(message);
+			}
+			catch (const std::exception& e) {
+				LOG(error) << "Dropping message: " << e.what();
+				return true;
+			}
+			uint64_t capacity = header->capacity;
+			uint64_t recordSize = sizeof(RecordHeader) + align(body.size());
+			if (recordSize > capacity) {
+				LOG(error) << "Dropping message of " << body.size() << " bytes: larger than the ring buffer";
+				return true;
+			}
+			uint64_t write = header->writePosition.load(std::memory_order_relaxed);
+			uint64_t read = header->readPosition.load(std::memory_order_acquire);
+			uint64_t offset = write & (capacity - 1);
+			uint64_t padding = offset + recordSize > capacity ? capacity - offset : 0;
+			if (write + padding + recordSize - read > capacity) {
+				return false;
+			}
+			if (padding > 0) {
+				RecordHeader record = { static_cast<uint32_t>(padding - sizeof(RecordHeader)), PaddingRecord, 0 };
+				memcpy(data + offset, &record, sizeof(record));
+				offset = 0;
+			}
+			RecordHeader record = { static_cast<uint32_t>(body.size()), MessageRecord, header->nextSequence++ };
+			memcpy(data + offset, &record, sizeof(record));
+			char* p = data + offset + sizeof(record);
+			for (const auto& segment : body.getSegments()) {
+				memcpy(p, segment->data(), segment->size());
+				p += segment->size();
+			}
+			header->writePosition.store(write + padding + recordSize, std::memory_order_release);
+			header->doorbell.fetch_add(1, std::memory_order_release);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (header->consumerWaiting.load(std::memory_order_relaxed)) {
+				syscall(SYS_futex, &header->doorbell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+			}
+			return true;
+		}
+
+		void publishPending() {
+			while (!pending.empty() && acquire() && publish(pending.front())) {
+				pending.pop_front();
+			}
+		}
+
+		void scheduleRetry() {
+			if (retrying) {
+				return;
+			}
+			retrying = true;
+			retryTimer.expires_from_now(std::chrono::milliseconds(10));
+			retryTimer.async_wait([this](const boost::system::error_code& ec) {
+				retrying = false;
+				if (ec) {
+					return;
+				}
+				publishPending();
+				if (!pending.empty()) {
+					scheduleRetry();
+				}
+			});
+		}
+
+		static uint64_t align(uint64_t size) {
+			return (size + sizeof(RecordHeader) - 1) & ~(sizeof(RecordHeader) - 1);
+		}
+
+		std::string path;
+		boost::asio::steady_timer retryTimer;
+		size_t mappingSize;
+		RingHeader* header;
+		char* data;
+		bool owner;
+		bool retrying;
+		std::deque<SMTPMessage> pending;
+};
+
+struct ExecSinkOptions {
+	enum Dispatch { LeastLoaded, RoundRobin };
+
+	ExecSinkOptions() : workers(1), dispatch(LeastLoaded), maxOutstanding(16), maxAttempts(3), stopTimeout(10) {}
+
+	std::string command; // Run with /bin/sh -c exec
+	size_t workers;
+	Dispatch dispatch;
+	size_t maxOutstanding; // Unacknowledged messages per worker
+	size_t maxAttempts; // Per message, before it is dropped
+	int stopTimeout; // Seconds to wait for workers to exit before killing them
+};
+
+// Streams messages to long-lived worker processes (--sink=exec). Each 
+// message is written to the stdin of a worker as its length (in bytes, in 
+// decimal) on a line, followed by the message as JSON (as in the HTTP 
+// request body) and a newline. For every message, in order, the worker 
+// writes a line to its stdout: "ok", or an error (which is logged).
+// When a worker exits, its unacknowledged messages are queued again (ahead 
+// of new messages, and at most maxAttempts times), and it is restarted 
+// after a second.
+class ExecSink : public MessageSink {
+	public:
+		ExecSink(boost::asio::io_service& ioService, const PriorityLanes& lanes, const ExecSinkOptions& options) : 
+				lanes(lanes), 
+				options(options), 
+				queue(lanes.getLanes()), 
+				next(0), 
+				draining(false), 
+				stopped(false) {
+			for (size_t i = 0; i < options.workers; ++i) {
+				workers.emplace_back(new Worker(ioService, i));
+				start(*workers.back());
+				if (!workers.back()->running) {
+					throw std::runtime_error("Unable to start worker: " + options.command);
+				}
+			}
+		}
+
+		~ExecSink() {
+			stop();
+		}
+
+		virtual void handle(const SMTPMessage& message) override {
+			queue.push(message, lanes.classify(message));
+			pump();
+		}
+
+		virtual void drain(DrainHandler handler) override {
+			draining = true;
+			drainHandler = handler;
+			checkDrained();
+		}
+
+		// Closes the workers' stdin, and waits for them to exit; workers that 
+		// are still running after the stop timeout are killed.
+		virtual void stop() override {
+			if (stopped) {
+				return;
+			}
+			stopped = true;
+			for (auto& worker : workers) {
+				worker->restartTimer.cancel();
+				if (worker->running) {
+					boost::system::error_code ignored;
+					worker->input.close(ignored);
+					worker->output.close(ignored);
+				}
+			}
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(options.stopTimeout);
+			for (auto& worker : workers) {
+				if (!worker->running) {
+					continue;
+				}
+				int status;
+				while (waitpid(worker->pid, &status, WNOHANG) == 0) {
+					if (std::chrono::steady_clock::now() >= deadline) {
+						LOG(warning) << "Killing worker " << worker->index << " (pid " << worker->pid << "): still running after " << options.stopTimeout << " seconds";
+						kill(worker->pid, SIGKILL);
+						waitpid(worker->pid, &status, 0);
+						break;
+					}
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				}
+				worker->running = false;
+			}
+		}
+
+	private:
+		struct Delivery {
+			SMTPMessage message;
+			size_t attempts; // Including the current one
+		};
+
+		struct Worker {
+			Worker(boost::asio::io_service& ioService, size_t index) : index(index), pid(-1), input(ioService), output(ioService), restartTimer(ioService), generation(0), running(false), writing(false) {}
+
+			size_t index;
+			pid_t pid;
+			boost::asio::posix::stream_descriptor input; // The worker's stdin
+			boost::asio::posix::stream_descriptor output; // The worker's stdout
+			boost::asio::streambuf acknowledgements;
+			boost::asio::steady_timer restartTimer;
+			size_t generation; // Of the process, to ignore completions for earlier ones
+			bool running;
+			std::deque<Delivery> outstanding; // Sent, and not acknowledged yet
+			std::vector<std::shared_ptr<const std::string>> outbox; // Frames not written yet
+			std::vector<std::shared_ptr<const std::string>> writeBuffers; // Being written
+			bool writing;
+		};
+
+		void start(Worker& worker) {
+			int stdinPipe[2];
+			int stdoutPipe[2];
+			if (pipe2(stdinPipe, O_CLOEXEC) < 0) {
+				LOG(error) << "Unable to start worker " << worker.index << ": " << strerror(errno);
+				return;
+			}
+			if (pipe2(stdoutPipe, O_CLOEXEC) < 0) {
+				LOG(error) << "Unable to start worker " << worker.index << ": " << strerror(errno);
+				close(stdinPipe[0]);
+				close(stdinPipe[1]);
+				return;
+			}
+			// With exec, the worker is the spawned process, and not a child of the shell
+			worker.pid = spawn("exec " + options.command, stdinPipe[0], stdoutPipe[1]);
+			int error = errno;
+			close(stdinPipe[0]);
+			close(stdoutPipe[1]);
+			if (worker.pid < 0) {
+				LOG(error) << "Unable to start worker " << worker.index << ": " << strerror(error);
+				close(stdinPipe[1]);
+				close(stdoutPipe[0]);
+				return;
+			}
+			worker.input.assign(stdinPipe[1]);
+			worker.output.assign(stdoutPipe[0]);
+			worker.acknowledgements.consume(worker.acknowledgements.size());
+			worker.running = true;
+			++worker.generation;
+			LOG(info) << "Started worker " << worker.index << " (pid " << worker.pid << ")";
+			readAcknowledgement(worker);
+		}
+
+		// Runs the command through /bin/sh with the given descriptors as its 
+		// stdin and stdout, and no other descriptors: sockets opened by asio 
+		// (and inherited listening sockets) aren't close-on-exec, and a worker 
+		// holding on to them would keep connections and ports open.
+		// Returns -1 (with errno set) if the process can't be created.
+		static pid_t spawn(const std::string& command, int stdinFD, int stdoutFD) {
+			const char* argv[] = { "sh", "-c", command.c_str(), NULL };
+			long maxFD = sysconf(_SC_OPEN_MAX);
+			pid_t pid = fork();
+			if (pid != 0) {
+				return pid;
+			}
+			// Only async-signal-safe calls in the child
+			redirect(stdinFD, STDIN_FILENO);
+			redirect(stdoutFD, STDOUT_FILENO);
+#ifdef SYS_close_range
+			if (syscall(SYS_close_range, 3, ~0U, 0) < 0)
+#endif
+			{
+				for (long fd = 3; fd < maxFD; ++fd) {
+					close(fd);
+				}
+			}
+			execv("/bin/sh", const_cast<char* const*>(argv));
+			_exit(127);
+		}
+
+		static void redirect(int fd, int target) {
+			if (fd == target) {
+				fcntl(fd, F_SETFD, 0);
+			}
+			else {
+				dup2(fd, target);
+			}
+		}
+
+		void pump() {
+			while (!draining && !stopped && (!retries.empty() || !queue.empty())) {
+				Worker* worker = selectWorker();
+				if (!worker) {
+					break;
+				}
+				if (!retries.empty()) {
+					Delivery delivery = std::move(retries.front());
+					retries.pop_front();
+					send(*worker, std::move(delivery.message), delivery.attempts);
+				}
+				else {
+					send(*worker, queue.pop(), 0);
+				}
+			}
+		}
+
+		// A running worker that can take another message, if any.
+		Worker* selectWorker() {
+			Worker* best = NULL;
+			for (size_t i = 0; i < workers.size(); ++i) {
+				Worker& worker = *workers[(next + i) % workers.size()];
+				if (!worker.running || worker.outstanding.size() >= options.maxOutstanding) {
+					continue;
+				}
+				if (options.dispatch == ExecSinkOptions::RoundRobin) {
+					next = (worker.index + 1) % workers.size();
+					return &worker;
+				}
+				if (!best || worker.outstanding.size() < best->outstanding.size()) {
+					best = &worker;
+				}
+			}
+			return best;
+		}
+
+		void send(Worker& worker, SMTPMessage message, size_t attempts) {
+			RequestBody body;
+			try {
+				body = RequestEncoder::encodeJSON(message);
+			}
+			catch (const std::exception& e) {
+				LOG(error) << "Dropping message: " << e.what();
+				return;
+			}
+			worker.outbox.push_back(std::make_shared<const std::string>(std::to_string(body.size()) + "\n"));
+			for (const auto& segment : body.getSegments()) {
+				worker.outbox.push_back(segment);
+			}
+			worker.outbox.push_back(newline);
+			worker.outstanding.push_back({std::move(message), attempts + 1});
+			write(worker);
+		}
+
+		// Writes all frames queued while the previous write was in progress 
+		// at once.
+		void write(Worker& worker) {
+			if (worker.writing || worker.outbox.empty()) {
+				return;
+			}
+			worker.writing = true;
+			worker.writeBuffers.swap(worker.outbox);
+			std::vector<boost::asio::const_buffer> buffers;
+			for (const auto& buffer : worker.writeBuffers) {
+				buffers.push_back(boost::asio::buffer(*buffer));
+			}
+			size_t generation = worker.generation;
+			boost::asio::async_write(worker.input, buffers, [this, &worker, generation](const boost::system::error_code& ec, size_t) {
+				if (generation != worker.generation) {
+					return;
+				}
+				worker.writing = false;
+				worker.writeBuffers.clear();
+				if (ec) {
+					fail(worker, ec.message());
+					return;
+				}
+				write(worker);
+			});
+		}
+
+		void readAcknowledgement(Worker& worker) {
+			size_t generation = worker.generation;
+			boost::asio::async_read_until(worker.output, worker.acknowledgements, '\n', [this, &worker, generation](const boost::system::error_code& ec, size_t length) {
+				if (generation != worker.generation) {
+					return;
+				}
+				if (ec) {
+					fail(worker, ec == boost::asio::error::eof ? "exited" : ec.message());
+					return;
+				}
+				std::string line(boost::asio::buffers_begin(worker.acknowledgements.data()), boost::asio::buffers_begin(worker.acknowledgements.data()) + length - 1);
+				worker.acknowledgements.consume(length);
+				if (!line.empty() && line.back() == '\r') {
+					line.pop_back();
+				}
+				if (worker.outstanding.empty()) {
+					LOG(warning) << "Unexpected output from worker " << worker.index << ": " << line;
+				}
+				else {
+					if (line != "ok") {
+						LOG(error) << "Error: Worker " << worker.index << " failed to process message: " << line;
+					}
+					worker.outstanding.pop_front();
+				}
+				readAcknowledgement(worker);
+				pump();
+				checkDrained();
+			});
+		}
+
+		void fail(Worker& worker, const std::string& reason) {
+			if (!worker.running) {
+				return;
+			}
+			worker.running = false;
+			++worker.generation;
+			boost::system::error_code ignored;
+			worker.input.close(ignored);
+			worker.output.close(ignored);
+			int status;
+			if (waitpid(worker.pid, &status, WNOHANG) == 0) {
+				kill(worker.pid, SIGKILL);
+				waitpid(worker.pid, &status, 0);
+			}
+			LOG(error) << "Worker " << worker.index << " (pid " << worker.pid << ") " << reason << "; requeueing " << worker.outstanding.size() << " message(s)";
+			for (auto& delivery : worker.outstanding) {
+				if (delivery.attempts >= options.maxAttempts) {
+					LOG(error) << "Dropping message from " << delivery.message.getFrom() << " after " << delivery.attempts << " attempts";
+					continue;
+				}
+				retries.push_back(std::move(delivery));
+			}
+			worker.outstanding.clear();
+			worker.outbox.clear();
+			worker.writeBuffers.clear();
+			worker.writing = false;
+			scheduleRestart(worker);
+			pump();
+			checkDrained();
+		}
+
+		void scheduleRestart(Worker& worker) {
+			worker.restartTimer.expires_from_now(std::chrono::seconds(1));
+			worker.restartTimer.async_wait([this, &worker](const boost::system::error_code& ec) {
+				if (ec || stopped) {
+					return;
+				}
+				start(worker);
+				if (worker.running) {
+					pump();
+				}
+				else {
+					scheduleRestart(worker);
+				}
+			});
+		}
+
+		void checkDrained() {
+			if (!draining || !drainHandler) {
+				return;
+			}
+			for (const auto& worker : workers) {
+				if (!worker->outstanding.empty()) {
+					return;
+				}
+			}
+			std::vector<SMTPMessage> messages;
+			for (auto& delivery : retries) {
+				messages.push_back(std::move(delivery.message));
+			}
+			retries.clear();
+			while (!queue.empty()) {
+				messages.push_back(queue.pop());
+			}
+			auto handler = std::move(drainHandler);
+			drainHandler = nullptr;
+			handler(std::move(messages));
+		}
+
+		static const std::shared_ptr<const std::string> newline;
+
+		const PriorityLanes& lanes;
+		ExecSinkOptions options;
+		std::vector<std::unique_ptr<Worker>> workers;
+		FairQueue queue;
+		std::deque<Delivery> retries; // From workers that exited
+		size_t next; // For round robin
+		bool draining;
+		bool stopped;
+		DrainHandler drainHandler;
+};
+
+const std::shared_ptr<const std::string> ExecSink::newline = std::make_shared<const std::string>("\n");
+
+// Non-cryptographic 64-bit hash that consumes 8 bytes at a time, and can 
+// be fed incrementally.
+class Hasher {
+	public:
+		Hasher() : state(0x9e3779b97f4a7c15ULL), pending(0), pendingSize(0), length(0) {
+		}
+
+		void update(const char* data, size_t size) {
+			length += size;
+			while (pendingSize > 0 && size > 0) {
+				updatePending(*data++);
+				--size;
+			}
+			for (; size >= 8; data += 8, size -= 8) {
+				uint64_t word;
+				memcpy(&word, data, 8);
+				mix(word);
+			}
+			while (size-- > 0) {
+				updatePending(*data++);
+			}
+		}
+
+		void update(const std::string& data) {
+			update(data.data(), data.size() + 1); // Include the terminator as separator
+		}
+
+		uint64_t finish() const {
+			uint64_t hash = state ^ pending ^ length;
+			hash ^= hash >> 33;
+			hash *= 0xff51afd7ed558ccdULL;
+			hash ^= hash >> 33;
+			hash *= 0xc4ceb9fe1a85ec53ULL;
+			hash ^= hash >> 33;
+			return hash;
+		}
+
+	private:
+		void updatePending(char c) {
+			pending |= static_cast<uint64_t>(static_cast<unsigned char>(c)) << (8 * pendingSize);
+			if (++pendingSize == 8) {
+				mix(pending);
+				pending = 0;
+				pendingSize = 0;
+			}
+		}
+
+		void mix(uint64_t word) {
+			word *= 0x87c37b91114253d5ULL;
+			word = (word << 31) | (word >> 33);
+			word *= 0x4cf5ad432745937fULL;
+			state ^= word;
+			state = ((state << 27) | (state >> 37)) * 5 + 0x52dce729;
+		}
+
+		uint64_t state;
+		uint64_t pending;
+		size_t pendingSize;
+		uint64_t length;
+};
+
+struct DeduplicationOptions {
+	DeduplicationOptions() : window(0), maxEntries(10000) {}
+
+	int window; // Seconds (0 = disabled)
+	size_t maxEntries;
+	std::vector<std::string> ignoredHeaders;
+};
+
+// Suppresses messages that are identical to a message received less than 
+// a window ago: same envelope, and same data apart from the ignored headers.
+// The first message is delivered immediately, with an ID. If duplicates of 
+// it were suppressed, a notice with the number of duplicates that refers to 
+// that ID is delivered when its window closes.
+//
+// Messages that were spilled to disk are hashed on a separate thread, so 
+// reading them back doesn't hold up the SMTP sessions.
+class Deduplicator : public SMTPHandler {
+	public:
+		Deduplicator(boost::asio::io_service& ioService, SMTPHandler& handler, const DeduplicationOptions& options) : 
+				ioService(ioService),
+				handler(handler),
+				options(options),
+				timer(ioService),
+				timerPending(false),
+				hashThread(1),
+				nextHashing(0) {
+		}
+
+		~Deduplicator() {
+			hashThread.join();
+		}
+
+		virtual void handle(const SMTPMessage& message) override {
+			if (message.getDataFile()) {
+				size_t id = nextHashing++;
+				hashing.emplace(id, message);
+				boost::asio::post(hashThread, [this, id, message]() {
+					uint64_t key = hash(message);
+					ioService.post([this, id, key]() {
+						auto i = hashing.find(id);
+						if (i == hashing.end()) {
+							return; // Flushed
+						}
+						SMTPMessage hashed = std::move(i->second);
+						hashing.erase(i);
+						deduplicate(hashed, key);
+					});
+				});
+				return;
+			}
+			deduplicate(message, hash(message));
+		}
+
+		// Delivers the messages that are still being hashed, and the duplicate 
+		// notices of all remembered messages, and forgets them
+		void flush() {
+			for (const auto& message : hashing) {
+				handler.handle(message.second);
+			}
+			hashing.clear();
+			while (!order.empty()) {
+				finish(order.front());
+			}
+			timer.cancel();
+		}
+
+	private:
+		typedef std::chrono::steady_clock Clock;
+
+		struct Entry {
+			Entry(SMTPMessage notice, Clock::time_point expiry) : notice(std::move(notice)), expiry(expiry), duplicates(0) {}
+
+			SMTPMessage notice; // The envelope of the message, without data
+			Clock::time_point expiry;
+			size_t duplicates;
+		};
+
+		void deduplicate(const SMTPMessage& message, uint64_t key) {
+			auto now = Clock::now();
+			expire(now);
+
+			auto i = entries.find(key);
+			if (i != entries.end()) {
+				++i->second.duplicates;
+				TRACE << "Suppressing duplicate message (" << i->second.duplicates << " so far)";
+				return;
+			}
+			if (entries.size() >= options.maxEntries) {
+				finish(order.front());
+			}
+			SMTPMessage first = message;
+			first.setID(createID(key));
+			SMTPMessage notice(message.getFrom(), message.getTo(), message.getRoutes(), std::make_shared<const std::string>());
+			notice.setClientAddress(message.getClientAddress());
+			notice.setID(first.getID());
+			entries.emplace(key, Entry(std::move(notice), now + std::chrono::seconds(options.window)));
+			order.push_back(key);
+			handler.handle(first);
+			scheduleExpiry();
+		}
+
+		// The hash of the content, and when its window started
+		static std::string createID(uint64_t key) {
+			std::ostringstream id;
+			id << std::hex << std::setw(16) << std::setfill('0') << key << std::dec << "-"
+				<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+			return id.str();
+		}
+
+		// All entries have the same window, so they expire in the order they 
+		// were added.
+		void expire(Clock::time_point now) {
+			while (!order.empty() && entries.find(order.front())->second.expiry <= now) {
+				finish(order.front());
+			}
+		}
+
+		void finish(uint64_t key) {
+			auto i = entries.find(key);
+			if (i->second.duplicates > 0) {
+				LOG(info) << "Suppressed " << i->second.duplicates << " duplicate(s) of message " << i->second.notice.getID();
+				SMTPMessage& notice = i->second.notice;
+				notice.setDuplicates(i->second.duplicates);
+				handler.handle(notice);
+			}
+			entries.erase(i);
+			order.pop_front();
+		}
+
+		void scheduleExpiry() {
+			if (timerPending || order.empty()) {
+				return;
+			}
+			timerPending = true;
+			timer.expires_at(entries.find(order.front())->second.expiry);
+			timer.async_wait([this](const boost::system::error_code& ec) {
+				timerPending = false;
+				if (!ec) {
+					expire(Clock::now());
+					scheduleExpiry();
+				}
+			});
+		}
+
+		uint64_t hash(const SMTPMessage& message) const {
+			Hasher hasher;
+			hasher.update(message.getFrom());
+			for (const auto& to : message.getTo()) {
+				hasher.update(to);
+			}
+			HeaderFilter filter(hasher, options.ignoredHeaders);
+			if (const auto& file = message.getDataFile()) {
+				std::array<char, 65536> buffer;
+				size_t offset = 0;
+				ssize_t size;
+				while ((size = file->read(offset, buffer.data(), buffer.size())) > 0) {
+					filter.update(buffer.data(), size);
+					offset += size;
+				}
+			}
+			else {
+				filter.update(message.getData().data(), message.getData().size());
+			}
+			return hasher.finish();
+		}
+
+		// Passes data on to the hasher, leaving out ignored headers (including
+		// their continuation lines)
+		class HeaderFilter {
+			public:
+				HeaderFilter(Hasher& hasher, const std::vector<std::string>& ignoredHeaders) : hasher(hasher), ignoredHeaders(ignoredHeaders), inHeaders(true), ignoring(false) {
+				}
+
+				void update(const char* data, size_t size) {
+					const char* end = data + size;
+					while (inHeaders && data != end) {
+						const char* newline = std::find(data, end, '\n');
+						line.append(data, newline);
+						if (newline == end) {
+							return;
+						}
+						receiveHeaderLine();
+						line.clear();
+						data = newline + 1;
+					}
+					hasher.update(data, end - data);
+				}
+
+			private:
+				void receiveHeaderLine() {
+					if (line.empty()) {
+						inHeaders = false;
+					}
+					else if (line[0] != ' ' && line[0] != '\t') {
+						std::string name = line.substr(0, line.find(':'));
+						ignoring = std::any_of(ignoredHeaders.begin(), ignoredHeaders.end(), [&name](const std::string& header) {
+							return boost::algorithm::iequals(header, name);
+						});
+					}
+					if (!ignoring) {
+						line += '\n';
+						hasher.update(line.data(), line.size());
+					}
+				}
+
+				Hasher& hasher;
+				const std::vector<std::string>& ignoredHeaders;
+				bool inHeaders;
+				bool ignoring;
+				std::string line;
+		};
+
+		boost::asio::io_service& ioService;
+		SMTPHandler& handler;
+		DeduplicationOptions options;
+		boost::asio::steady_timer timer;
+		bool timerPending;
+		std::unordered_map<uint64_t, Entry> entries;
+		std::deque<uint64_t> order;
+		boost::asio::thread_pool hashThread;
+		std::map<size_t, SMTPMessage> hashing; // Spilled messages being hashed, in order of arrival
+		size_t nextHashing;
+};
+
+// Collapses flapping HAProxy alerts. The first alert of a server is posted 
+// right away, and opens a window for that server. The alerts that follow 
+// within the window are summarized when it closes (first and last state, 
+// number of transitions, and when they happened), in a single message for 
+// all servers whose window closed; a server that changed again then gets a 
+// new window. Other messages are passed on as they are.
+class FlapAggregator : public SMTPHandler {
+	public:
+		FlapAggregator(boost::asio::io_service& ioService, SMTPHandler& handler, int window) : 
+				handler(handler),
+				window(window),
+				timer(ioService),
+				timerPending(false),
+				slots(64) {
+		}
+
+		virtual void handle(const SMTPMessage& message) override {
+			const auto& alert = message.getHAProxyAlert();
+			if (!alert) {
+				handler.handle(message);
+				return;
+			}
+
+			ServerState& state = getServerState(alert->proxy, alert->server);
+			if (!state.active) {
+				state.active = true;
+				state.windowEnd = getWindowEnd(Clock::now());
+				activeServers.push_back(static_cast<uint32_t>(&state - &servers[0]));
+				scheduleTimer();
+				handler.handle(message);
+				return;
+			}
+
+			auto now = std::chrono::system_clock::now();
+			if (state.transitions == 0) {
+				state.firstState = alert->state;
+				state.firstChange = now;
+			}
+			state.lastState = alert->state;
+			state.lastChange = now;
+			++state.transitions;
+			state.envelope = getEnvelope(message);
+			TRACE << "Aggregating alert for " << alert->proxy << "/" << alert->server << " (" << state.transitions << " transitions)";
+		}
+
+		// Posts the summaries of all open windows, and closes them
+		void flush() {
+			std::vector<uint32_t> changed;
+			for (auto index : activeServers) {
+				ServerState& state = servers[index];
+				if (state.transitions > 0) {
+					changed.push_back(index);
+				}
+				state.active = false;
+			}
+			activeServers.clear();
+			postSummaries(changed);
+			timer.cancel();
+		}
+
+	private:
+		typedef std::chrono::system_clock::time_point TimePoint;
+		typedef std::chrono::steady_clock Clock;
+
+		struct ServerState {
+			ServerState() : active(false), transitions(0), envelope(0) {}
+
+			std::string proxy;
+			std::string server;
+			bool active; // Whether a window is open
+			Clock::time_point windowEnd;
+			std::string firstState;
+			std::string lastState;
+			size_t transitions; // In the current window, after the alert that opened it
+			TimePoint firstChange;
+			TimePoint lastChange;
+			size_t envelope;
+		};
+
+		// Windows end on whole seconds, so servers that start flapping together
+		// are summarized together.
+		Clock::time_point getWindowEnd(Clock::time_point start) const {
+			return Clock::time_point(std::chrono::duration_cast<std::chrono::seconds>(start.time_since_epoch()) + std::chrono::seconds(window + 1));
+		}
+
+		// Windows are opened (and renewed) for a fixed duration, so the ones 
+		// that are open end no later than any window opened after them.
+		void scheduleTimer() {
+			if (timerPending || activeServers.empty()) {
+				return;
+			}
+			auto end = servers[activeServers.front()].windowEnd;
+			for (auto index : activeServers) {
+				end = std::min(end, servers[index].windowEnd);
+			}
+			timerPending = true;
+			timer.expires_at(end);
+			timer.async_wait([this](const boost::system::error_code& ec) {
+				timerPending = false;
+				if (!ec) {
+					closeWindows(Clock::now());
+					scheduleTimer();
+				}
+			});
+		}
+
+		// Summarizes the servers whose window ended, and renews the windows 
+		// of those that changed during it.
+		void closeWindows(Clock::time_point now) {
+			std::vector<uint32_t> changed;
+			std::vector<uint32_t> stillActive;
+			for (auto index : activeServers) {
+				ServerState& state = servers[index];
+				if (state.windowEnd > now) {
+					stillActive.push_back(index);
+				}
+				else if (state.transitions > 0) {
+					changed.push_back(index);
+					state.windowEnd += std::chrono::seconds(window);
+					stillActive.push_back(index);
+				}
+				else {
+					state.active = false;
+				}
+			}
+			activeServers.swap(stillActive);
+			postSummaries(changed);
+		}
+
+		// Posts one summary per envelope of the given servers
+		void postSummaries(const std::vector<uint32_t>& changed) {
+			for (size_t envelope = 0; envelope < envelopes.size(); ++envelope) {
+				auto summary = std::make_shared<json>(json::array());
+				std::string text = "Subject: [HAproxy Alert] Summary\n\n";
+				for (auto index : changed) {
+					const ServerState& state = servers[index];
+					if (state.envelope != envelope) {
+						continue;
+					}
+					summary->push_back({
+						{"proxy", state.proxy},
+						{"server", state.server},
+						{"firstState", state.firstState},
+						{"lastState", state.lastState},
+						{"transitions", state.transitions},
+						{"firstChange", formatTime(state.firstChange)},
+						{"lastChange", formatTime(state.lastChange)}
+					});
+					text += "Server " + state.proxy + "/" + state.server + " went from " + state.firstState + " to " + state.lastState + " (" + std::to_string(state.transitions) + " transitions)\n";
+				}
+				if (summary->empty()) {
+					continue;
+				}
+				const Envelope& e = envelopes[envelope];
+				SMTPMessage message(e.from, e.to, e.routes, std::make_shared<const std::string>(text));
+				message.setHAProxySummary(summary);
+				handler.handle(message);
+			}
+			for (auto index : changed) {
+				servers[index].transitions = 0;
+			}
+		}
+
+		struct Envelope {
+			std::string from;
+			std::vector<std::string> to;
+			std::vector<const Route*> routes;
+		};
+
+		struct Slot {
+			Slot() : hash(0), server(0) {}
+			uint64_t hash;
+			uint32_t server; // Index + 1 (0 = empty)
+		};
+
+		// Servers are never removed, so after all servers have been seen, 
+		// updates don't allocate.
+		ServerState& getServerState(const std::string& proxy, const std::string& server) {
+			// FNV-1a
+			uint64_t hash = 14695981039346656037ULL;
+			for (auto c : proxy) {
+				hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+			}
+			hash = (hash ^ '/') * 1099511628211ULL;
+			for (auto c : server) {
+				hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+			}
+
+			size_t mask = slots.size() - 1;
+			size_t i = (hash ^ (hash >> 32)) & mask;
+			while (slots[i].server != 0) {
+				ServerState& state = servers[slots[i].server - 1];
+				if (slots[i].hash == hash && state.proxy == proxy && state.server == server) {
+					return state;
+				}
+				i = (i + 1) & mask;
+			}
+
+			if ((servers.size() + 1) * 2 > slots.size()) {
+				grow();
+				return getServerState(proxy, server);
+			}
+			servers.emplace_back();
+			servers.back().proxy = proxy;
+			servers.back().server = server;
+			slots[i].hash = hash;
+			slots[i].server = static_cast<uint32_t>(servers.size());
+			return servers.back();
+		}
+
+		void grow() {
+			std::vector<Slot> oldSlots(slots.size() * 2);
+			oldSlots.swap(slots);
+			size_t mask = slots.size() - 1;
+			for (const auto& slot : oldSlots) {
+				if (slot.server != 0) {
+					size_t i = (slot.hash ^ (slot.hash >> 32)) & mask;
+					while (slots[i].server != 0) {
+						i = (i + 1) & mask;
+					}
+					slots[i] = slot;
+				}
+			}
+		}
+
+		size_t getEnvelope(const SMTPMessage& message) {
+			for (size_t i = 0; i < envelopes.size(); ++i) {
+				if (envelopes[i].from == message.getFrom() && envelopes[i].to == message.getTo()) {
+					return i;
+				}
+			}
+			envelopes.push_back({message.getFrom(), message.getTo(), message.getRoutes()});
+			return envelopes.size() - 1;
+		}
+
+		static std::string formatTime(TimePoint time) {
+			std::time_t t = std::chrono::system_clock::to_time_t(time);
+			std::tm tm;
+			gmtime_r(&t, &tm);
+			char result[32];
+			strftime(result, sizeof(result), "%Y-%m-%dT%H:%M:%SZ", &tm);
+			return result;
+		}
+
+		SMTPHandler& handler;
+		int window;
+		boost::asio::steady_timer timer;
+		bool timerPending;
+		std::vector<Slot> slots;
+		std::vector<ServerState> servers;
+		std::vector<uint32_t> activeServers;
+		std::vector<Envelope> envelopes;
+};
+
+class SMTPSession {
+	public:
+		SMTPSession(Sender& sender, SMTPHandler& handler, const RoutingTable& routingTable, const MessageOptions& options, const std::string& clientAddress) : sender(sender), handler(handler), routingTable(routingTable), options(options), clientAddress(clientAddress), receivingData(false), storageFailed(false) {
+		}
+
+		void reset() {
+			from = boost::optional<std::string>();
+			to.clear();
+			routes.clear();
+			std::string().swap(dataLines);
+			dataFile.reset();
+			storageFailed = false;
+			mimeParser.reset();
+		}
+
+		void start() {
+			send("220 " + boost::asio::ip::host_name());
+		}
+
+		void receive(const std::string& data) {
+			TRACE << "SMTP <- " << data;
+			if (receivingData) {
+				if (data == ".") {
+					receivingData = false;
+					std::shared_ptr<const MIMEContent> mimeContent;
+					try {
+						if (dataFile) {
+							dataFile->flush();
+						}
+						if (mimeParser) {
+							mimeContent = mimeParser->finish();
+						}
+					}
+					catch (const std::exception& e) {
+						LOG(error) << "Error storing message: " << e.what();
+						storageFailed = true;
+					}
+					if (storageFailed) {
+						send("452 Insufficient system storage");
+					}
+					else {
+						send("250 Ok");
+						if (from) {
+							SMTPMessage message(*from, to, routes, std::make_shared<const std::string>(std::move(dataLines)), mimeContent, dataFile);
+							if (options.parseHAProxyAlerts && !dataFile) {
+								bool knownSender = !options.haproxySender.empty() && boost::algorithm::iequals(boost::algorithm::trim_copy_if(*from, boost::algorithm::is_any_of("<> ")), options.haproxySender);
+								message.setHAProxyAlert(HAProxyAlertParser::parse(message.getData(), knownSender));
+							}
+							message.setClientAddress(clientAddress);
+							handler.handle(message);
+						}
+						else {
+							LOG(warning) << "Didn't receive FROM; not handling mail";
+						}
+					}
+					reset();
+				}
+				else if (!storageFailed) {
+					try {
+						receiveData(data);
+					}
+					catch (const std::exception& e) {
+						LOG(error) << "Error storing message: " << e.what();
+						storageFailed = true;
+					}
+				}
+			}
+			else {
+				if (boost::algorithm::starts_with(data, "EHLO") && sender.canStartTLS()) {
+					send("250-Hello\r\n250 STARTTLS");
+				}
+				else if (boost::algorithm::starts_with(data, "HELO") || boost::algorithm::starts_with(data, "EHLO")) {
+					send("250 Hello");
+				}
+				else if (boost::algorithm::starts_with(data, "STARTTLS") && sender.canStartTLS()) {
+					reset();
+					send("220 Ready to start TLS");
+					sender.startTLS();
+				}
+				else if (boost::algorithm::starts_with(data, "DATA")) {
+					receivingData = true;
+					if (options.parseMIME) {
+						mimeParser.reset(new MIMEParser(options));
+					}
+					send("354 Send data");
+				}
+				else if (boost::algorithm::starts_with(data, "QUIT")) {
+					send("221 Bye", true);
+				}
+				else if (boost::algorithm::starts_with(data, "MAIL FROM:")) {
+					reset();
+					from = data.substr(10);
+					send("250 Ok");
+				}
+				else if (boost::algorithm::starts_with(data, "RCPT TO:")) {
+					to.push_back(data.substr(8));
+					routes.push_back(&routingTable.resolve(to.back()));
+					send("250 Ok");
+				}
+				else if (boost::algorithm::starts_with(data, "NOOP")) {
+					send("250 Ok");
+				}
+				else if (boost::algorithm::starts_with(data, "RSET")) {
+					reset();
+					send("250 Ok");
+				}
+				else {
+					send("502 Command not implemented");
+				}
+			}
+		}
+
+		void send(const std::string& data, bool closeAfterNextWrite = false) {
+			TRACE << "SMTP -> " << data;
+			sender.send(data, closeAfterNextWrite);
+		}
+
+	
+	private:
+		// Data is kept in memory until it grows beyond the spill size
+		void receiveData(const std::string& data) {
+			if (dataFile) {
+				dataFile->write(data);
+				dataFile->write("\n", 1);
+			}
+			else {
+				dataLines += data;
+				dataLines += '\n';
+				if (options.spillSize > 0 && dataLines.size() > options.spillSize) {
+					dataFile = std::make_shared<SpillFile>(options.spillDirectory);
+					dataFile->write(dataLines);
+					std::string().swap(dataLines);
+				}
+			}
+			if (mimeParser) {
+				mimeParser->receive(data);
+			}
+		}
+
+		Sender& sender;
+		SMTPHandler& handler;
+		const RoutingTable& routingTable;
+		const MessageOptions& options;
+		std::string clientAddress;
+		bool receivingData;
+		bool storageFailed;
+		boost::optional<std::string> from;
+		std::vector<std::string> to;
+		std::vector<const Route*> routes;
+		std::string dataLines;
+		std::shared_ptr<SpillFile> dataFile;
+		std::unique_ptr<MIMEParser> mimeParser;
+};
+
+template<typename T>
+class LineBufferingReceiver {
+	public:
+		LineBufferingReceiver(T& target) : target(target), discarding(false) {}
+
+		template <typename InputIterator>
+		void receive(InputIterator begin, InputIterator end) {
+			while (begin != end) {
+				char c = *begin++;
+				if (c == '\n') {
+					if (!buffer.empty()) {
+						if (buffer.back() == '\r') {
+							buffer.pop_back();
+						}
+						target.receive(std::string(&buffer[0], buffer.size()));
+						buffer.clear();
+						if (discarding) {
+							discarding = false;
+							return;
+						}
+					}
+				}
+				else {
+					buffer.push_back(c);
+				}
+			}
+			// Don't hold on to (much) memory while waiting for the next line
+			if (buffer.empty() && buffer.capacity() > 256) {
+				std::vector<char>().swap(buffer);
+			}
+		}
+
+		// Drops the rest of the input that is being received
+		void discard() {
+			discarding = true;
+		}
+
+	private:
+		T& target;
+		std::vector<char> buffer;
+		bool discarding;
+};
+
+// Counts open connections, in total and per client address.
+// Per-address counts live in an open-addressing table, so tracking a 
+// connection doesn't allocate once the table has grown. I/O thread only.
+class ConnectionLimiter {
+	public:
+		typedef std::array<unsigned char, 16> Key;
+
+		ConnectionLimiter(size_t maxConnections, size_t maxConnectionsPerAddress) :
+				maxConnections(maxConnections),
+				maxConnectionsPerAddress(maxConnectionsPerAddress),
+				connections(0),
+				addresses(0),
+				slots(16) {
+		}
+
+		// Returns false if the connection would exceed a limit (0 = unlimited).
+		bool acquire(const address& clientAddress) {
+			if (maxConnections && connections >= maxConnections) {
+				return false;
+			}
+			Key key = toKey(clientAddress);
+			Slot& slot = findSlot(key);
+			if (slot.count == 0) {
+				if ((addresses + 1) * 2 > slots.size()) {
+					grow();
+					return acquire(clientAddress);
+				}
+				slot.key = key;
+				++addresses;
+			}
+			else if (maxConnectionsPerAddress && slot.count >= maxConnectionsPerAddress) {
+				return false;
+			}
+			++slot.count;
+			++connections;
+			return true;
+		}
+
+		void release(const address& clientAddress) {
+			Slot& slot = findSlot(toKey(clientAddress));
+			if (slot.count == 0) {
+				return;
+			}
+			--connections;
+			if (--slot.count == 0) {
+				--addresses;
+				erase(static_cast<size_t>(&slot - &slots[0]));
+			}
+		}
+
+		size_t getConnections() const {
+			return connections;
+		}
+
+	private:
+		struct Slot {
+			Slot() : count(0) {}
+			Key key;
+			uint32_t count;
+		};
+
+		static Key toKey(const address& clientAddress) {
+			if (clientAddress.is_v6()) {
+				return clientAddress.to_v6().to_bytes();
+			}
+			// Use the IPv4-mapped IPv6 address
+			Key key = {};
+			key[10] = key[11] = 0xff;
+			auto bytes = clientAddress.to_v4().to_bytes();
+			std::copy(bytes.begin(), bytes.end(), key.begin() + 12);
+			return key;
+		}
+
+		size_t indexOf(const Key& key) const {
+			// FNV-1a
+			uint64_t hash = 14695981039346656037ULL;
+			for (auto c : key) {
+				hash = (hash ^ c) * 1099511628211ULL;
+			}
+			return (hash ^ (hash >> 32)) & (slots.size() - 1);
+		}
+
+		// Returns the slot holding the key, or the empty slot where it belongs.
+		Slot& findSlot(const Key& key) {
+			size_t i = indexOf(key);
+			while (slots[i].count != 0 && slots[i].key != key) {
+				i = (i + 1) & (slots.size() - 1);
+			}
+			return slots[i];
+		}
+
+		// Backward-shift deletion, so that no tombstones are needed.
+		void erase(size_t hole) {
+			size_t mask = slots.size() - 1;
+			size_t i = hole;
+			while (true) {
+				i = (i + 1) & mask;
+				if (slots[i].count == 0) {
+					break;
+				}
+				size_t home = indexOf(slots[i].key);
+				if (((i - home) & mask) >= ((i - hole) & mask)) {
+					slots[hole] = slots[i];
+					slots[i].count = 0;
+					hole = i;
+				}
+			}
+			slots[hole].count = 0;
+		}
+
+		void grow() {
+			std::vector<Slot> oldSlots(slots.size() * 2);
+			oldSlots.swap(slots);
+			for (const auto& slot : oldSlots) {
+				if (slot.count != 0) {
+					findSlot(slot.key) = slot;
+				}
+			}
+		}
+
+		size_t maxConnections;
+		size_t maxConnectionsPerAddress;
+		size_t connections;
+		size_t addresses;
+		std::vector<Slot> slots;
+};
+
+#ifdef HAVE_OPENSSL
+// Server-side TLS settings, shared by all sessions.
+// Session tickets let returning clients resume without a full handshake.
+// Where the kernel (and OpenSSL) support it, the symmetric crypto is 
+// offloaded to the kernel (kTLS) after the handshake.
+class TLSContext {
+	public:
+		TLSContext(const std::string& certificateFile, const std::string& keyFile) : context(SSL_CTX_new(TLS_server_method())) {
+			if (!context) {
+				throw std::runtime_error("Unable to create TLS context");
+			}
+			SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+#ifdef SSL_OP_ENABLE_KTLS
+			SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+#endif
+			SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+			SSL_CTX_set_num_tickets(context, 1);
+			if (SSL_CTX_use_certificate_chain_file(context, certificateFile.c_str()) != 1) {
+				throw std::runtime_error("Unable to load TLS certificate from " + certificateFile);
+			}
+			if (SSL_CTX_use_PrivateKey_file(context, keyFile.c_str(), SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(context) != 1) {
+				throw std::runtime_error("Unable to load TLS key from " + keyFile);
+			}
+		}
+
+		~TLSContext() {
+			SSL_CTX_free(context);
+		}
+
+		TLSContext(const TLSContext&) = delete;
+		TLSContext& operator=(const TLSContext&) = delete;
+
+		SSL_CTX* get() const {
+			return context;
+		}
+
+	private:
+		SSL_CTX* context;
+};
+
+// TLS on a TCP socket. OpenSSL reads and writes the socket itself (so it 
+// can hand the connection over to kTLS), and asio only waits for the 
+// socket to become readable or writable.
+// Once both directions are offloaded to the kernel, the socket can be 
+// read and written as a plain socket.
+class TLSConnection {
+	public:
+		typedef std::function<void(const boost::system::error_code&, size_t)> Handler;
+
+		TLSConnection(const TLSContext& context, generic::stream_protocol::socket& socket) : ssl(SSL_new(context.get())), socket(socket), offloaded(false) {
+			SSL_set_fd(ssl, socket.native_handle());
+			SSL_set_accept_state(ssl);
+			socket.non_blocking(true);
+		}
+
+		~TLSConnection() {
+			SSL_free(ssl);
+		}
+
+		TLSConnection(const TLSConnection&) = delete;
+		TLSConnection& operator=(const TLSConnection&) = delete;
+
+		void asyncHandshake(Handler handler) {
+			perform([this]() { return SSL_do_handshake(ssl); }, [this, handler](const boost::system::error_code& ec, size_t) {
+				if (!ec) {
+					offloaded = BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+					TRACE << "TLS handshake done (" << SSL_get_version(ssl) << (SSL_session_reused(ssl) ? ", resumed" : "") << (offloaded ? ", kTLS" : "") << ")";
+				}
+				handler(ec, 0);
+			});
+		}
+
+		void asyncReadSome(char* data, size_t size, Handler handler) {
+			perform([this, data, size]() { return SSL_read(ssl, data, static_cast<int>(size)); }, handler);
+		}
+
+		// Writes all data (OpenSSL doesn't do partial writes by default)
+		void asyncWrite(const char* data, size_t size, Handler handler) {
+			perform([this, data, size]() { return SSL_write(ssl, data, static_cast<int>(size)); }, handler);
+		}
+
+		// Best-effort close_notify
+		void shutdown() {
+			SSL_shutdown(ssl);
+		}
+
+		bool isOffloaded() const {
+			return offloaded;
+		}
+
+		// Whether data can be read without waiting for the socket
+		bool hasPending() const {
+			return SSL_has_pending(ssl) == 1;
+		}
+
+	private:
+		// Retries the operation until it no longer needs to wait for the socket.
+		// Like asio operations, the handler is never called from within perform().
+		void perform(std::function<int()> operation, Handler handler) {
+			ERR_clear_error();
+			int result = operation();
+			if (result > 0) {
+				complete(handler, boost::system::error_code(), static_cast<size_t>(result));
+				return;
+			}
+			int error = SSL_get_error(ssl, result);
+			if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+				socket.async_wait(error == SSL_ERROR_WANT_READ ? generic::stream_protocol::socket::wait_read : generic::stream_protocol::socket::wait_write, [this, operation, handler](const boost::system::error_code& ec) {
+					if (ec) {
+						handler(ec, 0);
+					}
+					else {
+						perform(operation, handler);
+					}
+				});
+			}
+			else if (error == SSL_ERROR_SSL) {
+				complete(handler, boost::system::error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category()), 0);
+			}
+			else {
+				complete(handler, boost::asio::error::eof, 0);
+			}
+		}
+
+		void complete(Handler handler, const boost::system::error_code& ec, size_t size) {
+			boost::asio::post(socket.get_executor(), [handler, ec, size]() { handler(ec, size); });
+		}
+
+		SSL* ssl;
+		generic::stream_protocol::socket& socket;
+		bool offloaded;
+};
+#else
+// TLS is not available without OpenSSL
+class TLSContext {};
+#endif
+
+// A read buffer, borrowed from a per-thread pool for as long as data is 
+// being read and processed, so that idle sessions don't own one.
+class ReadBuffer {
+	public:
+		enum { Size = 8192 };
+
+		ReadBuffer() {
+			auto& pool = getPool();
+			if (pool.empty()) {
+				data.reset(new char[Size]);
+			}
+			else {
+				data = std::move(pool.back());
+				pool.pop_back();
+			}
+		}
+
+		~ReadBuffer() {
+			auto& pool = getPool();
+			if (pool.size() < maxPooled) {
+				pool.push_back(std::move(data));
+			}
+		}
+
+		ReadBuffer(const ReadBuffer&) = delete;
+		ReadBuffer& operator=(const ReadBuffer&) = delete;
+
+		char* get() {
+			return data.get();
+		}
+
+	private:
+		static const size_t maxPooled = 64;
+
+		static std::vector<std::unique_ptr<char[]>>& getPool() {
+			thread_local std::vector<std::unique_ptr<char[]>> pool;
+			return pool;
+		}
+
+		std::unique_ptr<char[]> data;
+};
+
+class Session : public std::enable_shared_from_this<Session>, public Sender {
+	public:
+		Session(generic::stream_protocol::socket socket, const address& clientAddress, ConnectionLimiter& connectionLimiter, SMTPHandler& handler, const RoutingTable& routingTable, const MessageOptions& messageOptions, const TLSContext* tlsContext, bool implicitTLS) :
+				socket(std::move(socket)),
+				clientAddress(clientAddress),
+				connectionLimiter(connectionLimiter),
+				tlsContext(tlsContext),
+				implicitTLS(implicitTLS),
+				reading(false),
+				startingTLS(false),
+				writing(false),
+				smtpSession(*this, handler, routingTable, messageOptions, clientAddress.to_string()),
+				receiver(smtpSession) {
+		}
+
+		~Session() {
+			connectionLimiter.release(clientAddress);
+		}
+
+		void start() {
+			boost::system::error_code errorCode;
+			socket.non_blocking(true, errorCode);
+			if (implicitTLS) {
+				auto self(shared_from_this());
+				startHandshake([this, self]() { smtpSession.start(); });
+			}
+			else {
+				smtpSession.start();
+			}
+		}
+
+		virtual bool canStartTLS() const override {
+#ifdef HAVE_OPENSSL
+			return tlsContext && !tls;
+#else
+			return false;
+#endif
+		}
+
+		virtual void startTLS() override {
+			startingTLS = true;
+			receiver.discard();
+		}
+
+		// Closes the connection, aborting the operations in progress
+		void close() {
+#ifdef HAVE_OPENSSL
+			if (tls) {
+				tls->shutdown();
+			}
+#endif
+			boost::system::error_code errorCode;
+			socket.shutdown(generic::stream_protocol::socket::shutdown_both, errorCode);
+			socket.close(errorCode);
+		}
+
+	private:
+		// Reading starts after the first reply has been written. Only one read 
+		// may be outstanding, or data would be read into the buffer twice.
+		// No reads are started between a STARTTLS and the handshake.
+		// With epoll, no read buffer is held while waiting for data: a buffer 
+		// is only borrowed once the socket is readable. With io_uring, waiting 
+		// and reading separately would take two system calls per read, so the 
+		// read is submitted right away, holding a buffer while the session is 
+		// idle.
+		void doRead() {
+			if (reading) {
+				return;
+			}
+			reading = true;
+#ifdef HAVE_OPENSSL
+			if (tls && !tls->isOffloaded() && tls->hasPending()) {
+				readTLS();
+				return;
+			}
+			if (tls && !tls->isOffloaded()) {
+				waitAndRead();
+				return;
+			}
+#endif
+#ifdef BOOST_ASIO_HAS_IO_URING_AS_DEFAULT
+			auto self(shared_from_this());
+			auto buffer = std::make_shared<ReadBuffer>();
+			socket.async_read_some(boost::asio::buffer(buffer->get(), ReadBuffer::Size), [this, self, buffer](boost::system::error_code ec, size_t length) {
+				reading = false;
+				if (!ec) {
+					receive(buffer->get(), length);
+				}
+			});
+#else
+			waitAndRead();
+#endif
+		}
+
+		void waitAndRead() {
+			auto self(shared_from_this());
+			socket.async_wait(generic::stream_protocol::socket::wait_read, [this, self](boost::system::error_code ec) {
+				if (ec) {
+					reading = false;
+					return;
+				}
+#ifdef HAVE_OPENSSL
+				if (tls && !tls->isOffloaded()) {
+					readTLS();
+					return;
+				}
+#endif
+				ReadBuffer buffer;
+				boost::system::error_code readError;
+				size_t length = socket.read_some(boost::asio::buffer(buffer.get(), ReadBuffer::Size), readError);
+				reading = false;
+				if (readError == boost::asio::error::would_block || readError == boost::asio::error::try_again) {
+					doRead();
+				}
+				else if (!readError) {
+					receive(buffer.get(), length);
+				}
+			});
+		}
+
+#ifdef HAVE_OPENSSL
+		void readTLS() {
+			auto self(shared_from_this());
+			auto buffer = std::make_shared<ReadBuffer>();
+			tls->asyncReadSome(buffer->get(), ReadBuffer::Size, [this, self, buffer](const boost::system::error_code& ec, size_t length) {
+				reading = false;
+				if (!ec) {
+					receive(buffer->get(), length);
+				}
+			});
+		}
+#endif
+
+		void receive(const char* data, size_t length) {
+			receiver.receive(data, data + length);
+			if (!startingTLS) {
+				doRead();
+			}
+		}
+
+		virtual void send(const std::string& command, bool closeAfterNextWrite) override {
+			outbox.push_back({std::make_shared<const std::string>(command + "\r\n"), closeAfterNextWrite});
+			if (!writing) {
+				writeNext();
+			}
+		}
+
+		// Replies are written one at a time, in order: a TLS write that has to 
+		// wait for the socket must be retried with the same data before 
+		// anything else is written.
+		void writeNext() {
+			if (outbox.empty()) {
+				writing = false;
+				return;
+			}
+			writing = true;
+			Reply reply = outbox.front();
+			auto self(shared_from_this());
+			auto handler = [this, self, reply](boost::system::error_code ec, std::size_t) {
+				outbox.pop_front();
+				if (ec) {
+					return;
+				}
+				if (reply.closeAfterWrite) {
+					close();
+				}
+				else if (startingTLS) {
+					startingTLS = false;
+					startHandshake([this, self]() { doRead(); writeNext(); });
+				}
+				else {
+					doRead();
+					writeNext();
+				}
+			};
+#ifdef HAVE_OPENSSL
+			if (tls && !tls->isOffloaded()) {
+				tls->asyncWrite(reply.data->data(), reply.data->size(), handler);
+				return;
+			}
+#endif
+			boost::asio::async_write(socket, boost::asio::buffer(*reply.data), handler);
+		}
+
+		void startHandshake(std::function<void()> done) {
+#ifdef HAVE_OPENSSL
+			tls.reset(new TLSConnection(*tlsContext, socket));
+			auto self(shared_from_this());
+			tls->asyncHandshake([this, self, done](const boost::system::error_code& ec, size_t) {
+				if (ec) {
+					LOG(info) << "TLS handshake with " << clientAddress << " failed: " << ec.message();
+					close();
+					return;
+				}
+				done();
+			});
+#else
+			(void) done;
+#endif
+		}
+
+		generic::stream_protocol::socket socket;
+		address clientAddress;
+		ConnectionLimiter& connectionLimiter;
+		const TLSContext* tlsContext; // NULL = no TLS
+		bool implicitTLS;
+#ifdef HAVE_OPENSSL
+		std::unique_ptr<TLSConnection> tls;
+#endif
+		bool reading;
+		bool startingTLS;
+		struct Reply {
+			std::shared_ptr<const std::string> data;
+			bool closeAfterWrite;
+		};
+		std::deque<Reply> outbox; // The first one is being written
+		bool writing;
+		SMTPSession smtpSession;
+		LineBufferingReceiver<SMTPSession> receiver;
+};
+
+class Server {
+	public:
+		// Listens on the given (inherited) listening sockets, or else on the 
+		// bind address, port, TLS port and Unix socket paths. Connections on 
+		// the TLS port start with a TLS handshake (implicit TLS); other 
+		// connections can use STARTTLS if a TLS context is given.
+		Server(
+				boost::asio::io_service& ioService, 
+				boost::asio::ip::address& bindAddress,
+				int port, 
+				int tlsPort,
+				const TLSContext* tlsContext,
+				const std::vector<int>& listenFDs,
+				const std::vector<std::string>& unixPaths,
+				boost::optional<int> notifyFD,
+				size_t maxConnections,
+				size_t maxConnectionsPerAddress,
+				SMTPHandler& handler,
+				const RoutingTable& routingTable,
+				const MessageOptions& messageOptions) :
+					handler(handler),
+					routingTable(routingTable),
+					messageOptions(messageOptions),
+					connectionLimiter(maxConnections, maxConnectionsPerAddress),
+					tlsContext(tlsContext) {
+			for (int fd : listenFDs) {
+				listeners.emplace_back(new Listener(ioService));
+				listeners.back()->acceptor.assign(getProtocol(fd), fd);
+			}
+			if (listeners.empty()) {
+				if (port > 0) {
+					listen(ioService, tcp::endpoint(bindAddress, port));
+				}
+				if (tlsContext && tlsPort > 0) {
+					listen(ioService, tcp::endpoint(bindAddress, tlsPort));
+				}
+				for (const auto& path : unixPaths) {
+					listen(ioService, path);
+				}
+			}
+			for (const auto& listener : listeners) {
+				auto endpoint = toTCP(listener->acceptor.local_endpoint());
+				listener->implicitTLS = tlsContext && tlsPort > 0 && endpoint && endpoint->port() == tlsPort;
+				doAccept(*listener);
+			}
+			if (notifyFD) {
+				auto writeResult = write(*notifyFD, "\n", 1);
+				if (writeResult <= 0) { LOG(error) << "Error " << writeResult << " writing to descriptor " << *notifyFD; }
+				auto closeResult = close(*notifyFD);
+				if (closeResult < 0) { LOG(error) << "Error " << closeResult << " closing descriptor " << *notifyFD; }
+			}
+			for (const auto& listener : listeners) {
+				LOG(info) << "Listening for SMTP" << (listener->implicitTLS ? "S" : "") << " connections on " << describe(listener->acceptor.local_endpoint());
+			}
+		}
+
+		std::vector<int> getListenFDs() {
+			std::vector<int> fds;
+			for (const auto& listener : listeners) {
+				fds.push_back(listener->acceptor.native_handle());
+			}
+			return fds;
+		}
+
+		// Open connections are served until their client quits
+		void stopAccepting() {
+			for (const auto& listener : listeners) {
+				boost::system::error_code errorCode;
+				listener->acceptor.close(errorCode);
+			}
+		}
+
+		size_t getConnections() const {
+			return connectionLimiter.getConnections();
+		}
+
+		void closeConnections() {
+			for (const auto& session : sessions) {
+				if (auto s = session.lock()) {
+					s->close();
+				}
+			}
+			sessions.clear();
+		}
+
+	private:
+		struct Listener {
+			Listener(boost::asio::io_service& ioService) : acceptor(ioService), socket(ioService), implicitTLS(false) {}
+
+			boost::asio::basic_socket_acceptor<generic::stream_protocol> acceptor; // TCP or Unix
+			generic::stream_protocol::socket socket; // The connection being accepted
+			bool implicitTLS;
+		};
+
+		void listen(boost::asio::io_service& ioService, const tcp::endpoint& endpoint) {
+			listeners.emplace_back(new Listener(ioService));
+			auto& acceptor = listeners.back()->acceptor;
+			acceptor.open(endpoint.protocol());
+			acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+			acceptor.bind(endpoint);
+			acceptor.listen();
+		}
+
+		void listen(boost::asio::io_service& ioService, const std::string& path) {
+			// Remove the socket of a previous run
+			struct stat info;
+			if (stat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+				unlink(path.c_str());
+			}
+			listeners.emplace_back(new Listener(ioService));
+			auto& acceptor = listeners.back()->acceptor;
+			local::stream_protocol::endpoint endpoint(path);
+			acceptor.open(endpoint.protocol());
+			acceptor.bind(endpoint);
+			acceptor.listen();
+		}
+
+		static generic::stream_protocol getProtocol(int fd) {
+			sockaddr_storage address;
+			socklen_t length = sizeof(address);
+			if (getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) < 0) {
+				throw std::runtime_error(std::string("Invalid listening socket: ") + strerror(errno));
+			}
+			if (address.ss_family == AF_UNIX) {
+				return local::stream_protocol();
+			}
+			if (address.ss_family != AF_INET && address.ss_family != AF_INET6) {
+				throw std::runtime_error("Listening socket " + std::to_string(fd) + " is not a TCP or Unix socket");
+			}
+			return address.ss_family == AF_INET6 ? tcp::v6() : tcp::v4();
+		}
+
+		static boost::optional<tcp::endpoint> toTCP(const generic::stream_protocol::endpoint& endpoint) {
+			if (endpoint.protocol().family() != AF_INET && endpoint.protocol().family() != AF_INET6) {
+				return boost::none;
+			}
+			tcp::endpoint result;
+			memcpy(result.data(), endpoint.data(), endpoint.size());
+			result.resize(endpoint.size());
+			return result;
+		}
+
+		static std::string describe(const generic::stream_protocol::endpoint& endpoint) {
+			if (auto tcpEndpoint = toTCP(endpoint)) {
+				std::ostringstream result;
+				result << *tcpEndpoint;
+				return result.str();
+			}
+			local::stream_protocol::endpoint localEndpoint;
+			memcpy(localEndpoint.data(), endpoint.data(), endpoint.size());
+			localEndpoint.resize(endpoint.size());
+			return "unix:" + localEndpoint.path();
+		}
+
+		// Clients on Unix sockets count as the local host (e.g. for 
+		// --max-connections-per-ip).
+		static address getClientAddress(const generic::stream_protocol::endpoint& endpoint) {
+			if (auto tcpEndpoint = toTCP(endpoint)) {
+				return tcpEndpoint->address();
+			}
+			return boost::asio::ip::address_v4::loopback();
+		}
+
+		void doAccept(Listener& listener) {
+			listener.acceptor.async_accept(listener.socket, [this, &listener](boost::system::error_code ec) {
+				if (!listener.acceptor.is_open()) {
+					return;
+				}
+				auto& socket = listener.socket;
+				if (!ec) {
+					boost::system::error_code endpointError;
+					auto clientAddress = getClientAddress(socket.remote_endpoint(endpointError));
+					if (endpointError) {
+						socket.close();
+					}
+					else if (!connectionLimiter.acquire(clientAddress)) {
+						LOG(warning) << "Rejecting connection from " << clientAddress << ": too many connections (" << connectionLimiter.getConnections() << " open)";
+						reject(socket);
+					}
+					else {
+						auto session = std::make_shared<Session>(std::move(socket), clientAddress, connectionLimiter, handler, routingTable, messageOptions, tlsContext, listener.implicitTLS);
+						session->start();
+						trackSession(session);
+					}
+				}
+				doAccept(listener);
+			});
+		}
+
+		// Sessions own themselves; they are only remembered to be able to 
+		// close them. Ended sessions are forgotten as more are started.
+		void trackSession(const std::shared_ptr<Session>& session) {
+			if (sessions.size() >= 2 * getConnections() + 16) {
+				sessions.erase(std::remove_if(sessions.begin(), sessions.end(), [](const std::weak_ptr<Session>& s) { return s.expired(); }), sessions.end());
+			}
+			sessions.push_back(session);
 		}
 
-	private:
-		void run() {
-			while (!stopRequested) {
-				boost::optional<SMTPMessage> message;
-				{
-					std::unique_lock<std::mutex> lock(queueMutex);
-					queueNonEmpty.wait(lock, [this]() { return !queue.empty() || stopRequested; });
-					if (stopRequested) { break; }
-					message = queue.front();
-					queue.pop_front();
-				}
-				doHandle(*message);
-			}
+		// Best-effort rejection: don't wait for the client to read the reply.
+		static void reject(generic::stream_protocol::socket& socket) {
+			static const char response[] = "421 Too many connections, try again later\r\n";
+			boost::system::error_code errorCode;
+			socket.non_blocking(true, errorCode);
+			socket.write_some(boost::asio::buffer(response, sizeof(response) - 1), errorCode);
+			socket.shutdown(generic::stream_protocol::socket::shutdown_both, errorCode);
+			socket.close(errorCode);
 		}
 
-		void doHandle(const SMTPMessage& message) {
-			json j;
-			j["envelope"] = {
-				{"from", message.getFrom()},
-				{"to", message.getTo()}
-			};
-			j["data"] = message.getData();
-			std::string body = j.dump();
+		SMTPHandler& handler;
+		const RoutingTable& routingTable;
+		const MessageOptions& messageOptions;
+		ConnectionLimiter connectionLimiter;
+		const TLSContext* tlsContext;
+		std::vector<std::unique_ptr<Listener>> listeners;
+		std::vector<std::weak_ptr<Session>> sessions;
+};
 
-			LOG(info) << "Processing message: " << body;
+// Hands the listening socket and the undelivered messages over to a new 
+// process (--hot-restart-socket).
+//
+// A starting process connects to the Unix socket of the running process, 
+// which sends it its listening socket (SCM_RIGHTS), and stops accepting 
+// connections. When its last SMTP session has ended (or was closed because 
+// it didn't end within the timeout) and its HTTP requests in flight have 
+// finished, the old process sends its undelivered messages over the same 
+// connection and exits. Each message is sent as a JSON line 
+// ({"from": ..., "to": [...], "client": ..., "size": ...}, and the "id", 
+// "duplicates" and "haproxySummary" of the message if it has them) 
+// followed by its data.
+//
+// The messages already went through the deduplication and aggregation of 
+// the old process, so the new process hands them to its sink directly. 
+// Messages received over SMTP are stored, parsed and routed as if they came 
+// in over SMTP again; duplicate notices and HAProxy summaries are restored 
+// as they are.
+class HotRestart {
+	public:
+		typedef std::function<void(MessageSink::DrainHandler)> DrainFunction;
 
-			std::shared_ptr<CURL> curl(curl_easy_init(), curl_easy_cleanup);
-			struct curl_slist *slist = NULL; 
-			slist = curl_slist_append(slist, "Content-Type: application/json"); 
-			for (const auto& header : headers) {
-				curl_slist_append(slist, header.c_str());
-			}
-			curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, slist); 
-			curl_easy_setopt(curl.get(), CURLOPT_CUSTOMREQUEST, "POST");
-			curl_easy_setopt(curl.get(), CURLOPT_POSTFIELDS, body.c_str());
-			curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, curlWriteCallback);
-			curl_easy_setopt(curl.get(), CURLOPT_DEBUGFUNCTION, curlDebugCallback);
-			curl_easy_setopt(curl.get(), CURLOPT_VERBOSE, 1);
-			curl_easy_setopt(curl.get(), CURLOPT_FOLLOWLOCATION, 1);
-			curl_easy_setopt(curl.get(), CURLOPT_MAXREDIRS, 5);
-			curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
+		HotRestart(boost::asio::io_service& ioService, const std::string& path, int timeout) : 
+				ioService(ioService),
+				path(path),
+				acceptor(ioService),
+				connection(ioService),
+				handoff(ioService),
+				timeout(timeout),
+				pollTimer(ioService),
+				server(NULL) {
+		}
 
-			auto ret = curl_easy_perform(curl.get());
-			if (ret != CURLE_OK) {
-				LOG(error) << "ERROR " << curl_easy_strerror(ret) << std::endl;
+		// Returns the listening sockets of the running process, if there is one.
+		// If the running process doesn't hand them over within the timeout, 
+		// starts without them.
+		std::vector<int> takeOver() {
+			boost::system::error_code errorCode;
+			local::stream_protocol::endpoint endpoint(path);
+			connection.open();
+			if (timeout > 0) {
+				// Also bounds connect(), which blocks while the backlog is full
+				timeval tv = { timeout, 0 };
+				setsockopt(connection.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+				setsockopt(connection.native_handle(), SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 			}
-			long statusCode;
-			ret = curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &statusCode);
-			if (ret != CURLE_OK) {
-				LOG(error) << "ERROR " << curl_easy_strerror(ret) << std::endl;
+			// Not connection.connect(), which waits without a limit when connect() times out
+			int result;
+			do {
+				result = ::connect(connection.native_handle(), endpoint.data(), endpoint.size());
+			} while (result < 0 && errno == EINTR);
+			if (result < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					LOG(error) << "Running process didn't accept the hot restart connection within " << timeout << "s; starting without its listening socket(s)";
+				}
+				connection.close(errorCode);
+				return std::vector<int>();
+			}
+			std::vector<int> fds;
+			try {
+				fds = receiveFileDescriptors(connection.native_handle());
 			}
-			if (statusCode != 200) {
-				LOG(error) << "Error: Unexpected status code: " << statusCode;
+			catch (const std::exception& e) {
+				LOG(error) << "Hot restart failed: " << e.what() << "; starting without the listening socket(s) of the running process";
+				connection.close(errorCode);
+				return std::vector<int>();
 			}
+			LOG(info) << "Took over " << fds.size() << " listening socket(s) from running process";
+			return fds;
 		}
 
-	private:
-		std::string url;
-		std::vector<std::string> headers;
-		std::atomic_bool stopRequested;
-		std::thread* thread;
-		std::deque<SMTPMessage> queue;
-		std::mutex queueMutex;
-		std::condition_variable queueNonEmpty;
-};
+		// Receives the messages of the previous process (if any), and waits 
+		// for the next process.
+		void start(Server& server, SMTPHandler& handler, const RoutingTable& routingTable, const MessageOptions& messageOptions, DrainFunction drain) {
+			this->server = &server;
+			this->drain = drain;
+			if (connection.is_open()) {
+				replay.reset(new Replay(handler, routingTable, messageOptions));
+				receiveHeader();
+			}
 
-class SMTPSession {
-	public:
-		SMTPSession(Sender& sender, SMTPHandler& handler) : sender(sender), handler(handler), receivingData(false) {
+			unlink(path.c_str());
+			acceptor.open();
+			acceptor.bind(local::stream_protocol::endpoint(path));
+			acceptor.listen();
+			acceptor.async_accept(handoff, [this](boost::system::error_code ec) {
+				if (!ec) {
+					handOver();
+				}
+			});
 		}
 
-		void reset() {
-			from = boost::optional<std::string>();
-			to.clear();
-			dataLines.str("");
-			dataLines.clear();
-		}
+	private:
+		class NullSender : public Sender {
+			public:
+				virtual void send(const std::string&, bool) override {}
+		};
 
-		void start() {
-			send("220 " + boost::asio::ip::host_name());
-		}
+		// Gives replayed messages the ID they had in the previous process
+		class IDRestorer : public SMTPHandler {
+			public:
+				IDRestorer(SMTPHandler& handler, const std::string& id) : handler(handler), id(id) {}
 
-		void receive(const std::string& data) {
-			LOG(debug) << "SMTP <- " << data;
-			if (receivingData) {
-				if (data == ".") {
-					receivingData = false;
-					send("250 Ok");
-					if (from) {
-						handler.handle(SMTPMessage(*from, to, dataLines.str()));
-					}
-					else {
-						LOG(warning) << "Didn't receive FROM; not handling mail";
+				virtual void handle(const SMTPMessage& message) override {
+					if (id.empty()) {
+						handler.handle(message);
+						return;
 					}
-					reset();
-				}
-				else {
-					dataLines << data << std::endl;
+					SMTPMessage restored = message;
+					restored.setID(id);
+					handler.handle(restored);
 				}
+
+			private:
+				SMTPHandler& handler;
+				std::string id;
+		};
+
+		struct Replay {
+			Replay(SMTPHandler& handler, const RoutingTable& routingTable, const MessageOptions& messageOptions) : handler(handler), routingTable(routingTable), messageOptions(messageOptions), messages(0) {}
+
+			SMTPHandler& handler;
+			const RoutingTable& routingTable;
+			const MessageOptions& messageOptions;
+			boost::asio::streambuf buffer;
+			json header;
+			std::string data;
+			size_t messages;
+		};
+
+		void handOver() {
+			acceptor.close();
+			try {
+				sendFileDescriptors(handoff.native_handle(), server->getListenFDs());
 			}
-			else {
-				if (boost::algorithm::starts_with(data, "HELO") || boost::algorithm::starts_with(data, "EHLO")) {
-					send("250 Hello");
-				}
-				else if (boost::algorithm::starts_with(data, "DATA")) {
-					receivingData = true;
-					send("354 Send data");
-				}
-				else if (boost::algorithm::starts_with(data, "QUIT")) {
-					send("221 Bye", true);
+			catch (const std::exception& e) {
+				LOG(error) << "Hot restart failed: " << e.what();
+				handoff.close();
+				return;
+			}
+			LOG(info) << "Handed over listening socket(s); waiting for " << server->getConnections() << " open connection(s)";
+			server->stopAccepting();
+			deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+			waitForConnections();
+		}
+
+		void waitForConnections() {
+			if (server->getConnections() > 0) {
+				if (timeout > 0 && deadline && std::chrono::steady_clock::now() >= *deadline) {
+					LOG(warning) << "Closing " << server->getConnections() << " connection(s) that didn't end within " << timeout << "s";
+					server->closeConnections();
+					deadline = boost::none;
 				}
-				else if (boost::algorithm::starts_with(data, "MAIL FROM:")) {
-					reset();
-					from = data.substr(10);
-					send("250 Ok");
+				pollTimer.expires_from_now(std::chrono::milliseconds(100));
+				pollTimer.async_wait([this](const boost::system::error_code& ec) {
+					if (!ec) {
+						waitForConnections();
+					}
+				});
+				return;
+			}
+			drain([this](std::vector<SMTPMessage> messages) {
+				sendMessages(messages);
+			});
+		}
+
+		void sendMessages(const std::vector<SMTPMessage>& messages) {
+			LOG(info) << "Handing over " << messages.size() << " undelivered message(s)";
+			boost::system::error_code errorCode;
+			for (const auto& message : messages) {
+				json header = {
+					{"from", message.getFrom()},
+					{"to", message.getTo()},
+					{"client", message.getClientAddress()},
+					{"size", message.getDataSize()}
+				};
+				if (!message.getID().empty()) {
+					header["id"] = message.getID();
 				}
-				else if (boost::algorithm::starts_with(data, "RCPT TO:")) {
-					to.push_back(data.substr(8));
-					send("250 Ok");
+				if (message.getDuplicates() > 0) {
+					header["duplicates"] = message.getDuplicates();
 				}
-				else if (boost::algorithm::starts_with(data, "NOOP")) {
-					send("250 Ok");
+				if (message.getHAProxySummary()) {
+					header["haproxySummary"] = *message.getHAProxySummary();
 				}
-				else if (boost::algorithm::starts_with(data, "RSET")) {
-					reset();
-					send("250 Ok");
+				boost::asio::write(handoff, boost::asio::buffer(header.dump() + "\n"), errorCode);
+				if (const auto& file = message.getDataFile()) {
+					std::array<char, 65536> buffer;
+					size_t offset = 0;
+					ssize_t size;
+					while (!errorCode && (size = file->read(offset, buffer.data(), buffer.size())) > 0) {
+						boost::asio::write(handoff, boost::asio::buffer(buffer.data(), size), errorCode);
+						offset += size;
+					}
 				}
 				else {
-					send("502 Command not implemented");
+					boost::asio::write(handoff, boost::asio::buffer(message.getData()), errorCode);
+				}
+				if (errorCode) {
+					LOG(error) << "Error handing over messages: " << errorCode.message();
+					break;
 				}
 			}
+			handoff.close();
+			ioService.stop();
 		}
 
-		void send(const std::string& data, bool closeAfterNextWrite = false) {
-			LOG(debug) << "SMTP -> " << data;
-			sender.send(data, closeAfterNextWrite);
-		}
-
-	
-	private:
-		Sender& sender;
-		SMTPHandler& handler;
-		bool receivingData;
-		boost::optional<std::string> from;
-		std::vector<std::string> to;
-		std::stringstream dataLines;
-};
-
-template<typename T>
-class LineBufferingReceiver {
-	public:
-		LineBufferingReceiver(T& target) : target(target) {}
-
-		template <typename InputIterator>
-		void receive(InputIterator begin, InputIterator end) {
-			while (begin != end) {
-				char c = *begin++;
-				if (c == '\n') {
-					if (!buffer.empty()) {
-						if (buffer.back() == '\r') {
-							buffer.pop_back();
-						}
-						target.receive(std::string(&buffer[0], buffer.size()));
-						buffer.clear();
+		void receiveHeader() {
+			boost::asio::async_read_until(connection, replay->buffer, '\n', [this](boost::system::error_code ec, size_t length) {
+				if (ec) {
+					if (ec != boost::asio::error::eof) {
+						LOG(error) << "Error receiving messages from previous process: " << ec.message();
 					}
+					LOG(info) << "Received " << replay->messages << " undelivered message(s) from previous process";
+					connection.close();
+					replay.reset();
+					return;
 				}
-				else {
-					buffer.push_back(c);
+				std::string line(boost::asio::buffers_begin(replay->buffer.data()), boost::asio::buffers_begin(replay->buffer.data()) + length);
+				replay->buffer.consume(length);
+				size_t size;
+				try {
+					replay->header = json::parse(line);
+					size = replay->header.at("size").get<size_t>();
 				}
-			}
-		}
-
-	private:
-		T& target;
-		std::vector<char> buffer;
-};
-
-class Session : public std::enable_shared_from_this<Session>, public Sender {
-	public:
-		Session(tcp::socket socket, HTTPPoster& httpPoster) :
-				socket(std::move(socket)),
-				smtpSession(*this, httpPoster),
-				receiver(smtpSession) {
+				catch (const std::exception& e) {
+					stopReplay(std::string("Invalid message header: ") + e.what());
+					return;
+				}
+				replay->data.resize(size);
+				size_t buffered = std::min(size, replay->buffer.size());
+				boost::asio::buffer_copy(boost::asio::buffer(&replay->data[0], buffered), replay->buffer.data());
+				replay->buffer.consume(buffered);
+				boost::asio::async_read(connection, boost::asio::buffer(&replay->data[buffered], size - buffered), [this](boost::system::error_code ec, size_t) {
+					if (ec) {
+						stopReplay(ec.message());
+						return;
+					}
+					try {
+						receiveMessage();
+					}
+					catch (const std::exception& e) {
+						stopReplay(e.what());
+						return;
+					}
+					receiveHeader();
+				});
+			});
 		}
 
-		void start() {
-			smtpSession.start();
+		void stopReplay(const std::string& error) {
+			LOG(error) << "Error receiving messages from previous process: " << error;
+			LOG(info) << "Received " << replay->messages << " undelivered message(s) from previous process";
+			boost::system::error_code errorCode;
+			connection.close(errorCode);
+			replay.reset();
 		}
 
-	private:
-		void doRead() {
-			auto self(shared_from_this());
-			socket.async_read_some(
-					boost::asio::buffer(buffer),
-					[this, self](boost::system::error_code ec, std::size_t length) {
-						if (!ec) {
-							receiver.receive(buffer.data(), buffer.data() + length);
-							doRead();
-						}
-					});
+		void receiveMessage() {
+			const json& header = replay->header;
+			auto from = header.at("from").get<std::string>();
+			auto to = header.at("to").get<std::vector<std::string>>();
+			auto client = header.at("client").get<std::string>();
+			if (header.count("duplicates") || header.count("haproxySummary")) {
+				std::vector<const Route*> routes;
+				for (const auto& recipient : to) {
+					routes.push_back(&replay->routingTable.resolve(recipient));
+				}
+				SMTPMessage message(from, to, routes, std::make_shared<const std::string>(std::move(replay->data)));
+				message.setClientAddress(client);
+				if (header.count("id")) {
+					message.setID(header["id"].get<std::string>());
+				}
+				if (header.count("duplicates")) {
+					message.setDuplicates(header["duplicates"].get<size_t>());
+				}
+				if (header.count("haproxySummary")) {
+					message.setHAProxySummary(std::make_shared<const json>(header["haproxySummary"]));
+				}
+				replay->handler.handle(message);
+			}
+			else {
+				IDRestorer handler(replay->handler, header.count("id") ? header["id"].get<std::string>() : std::string());
+				replaySMTP(handler, from, to, client);
+			}
+			++replay->messages;
 		}
 
-		virtual void send(const std::string& command, bool closeAfterNextWrite) override {
-			std::string cmd = command + "\r\n";
-			auto self(shared_from_this());
-			boost::asio::async_write(
-					socket, boost::asio::buffer(cmd, cmd.size()),
-					[this, self, closeAfterNextWrite](boost::system::error_code ec, std::size_t) {
-						if (!ec) {
-							if (closeAfterNextWrite) {
-								boost::system::error_code errorCode;
-								socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, errorCode);
-								socket.close();
-							}
-							else {
-								doRead();
-							}
-						}
-					});
+		// Feeds the message through an SMTP session, so it is stored, parsed 
+		// and routed with the options of this process.
+		void replaySMTP(SMTPHandler& handler, const std::string& from, const std::vector<std::string>& to, const std::string& client) {
+			NullSender sender;
+			SMTPSession session(sender, handler, replay->routingTable, replay->messageOptions, client);
+			session.receive("MAIL FROM:" + from);
+			for (const auto& recipient : to) {
+				session.receive("RCPT TO:" + recipient);
+			}
+			session.receive("DATA");
+			const std::string& data = replay->data;
+			size_t begin = 0;
+			while (begin < data.size()) {
+				size_t end = data.find('\n', begin);
+				if (end == std::string::npos) {
+					end = data.size();
+				}
+				session.receive(data.substr(begin, end - begin));
+				begin = end + 1;
+			}
+			session.receive(".");
 		}
 
-		tcp::socket socket;
-		enum { maxLength = 8192 };
-		std::array<char, 8192> buffer;
-		SMTPSession smtpSession;
-		LineBufferingReceiver<SMTPSession> receiver;
-};
-
-class Server {
-	public:
-		Server(
-				boost::asio::io_service& ioService, 
-				boost::asio::ip::address& bindAddress,
-				int port, 
-				boost::optional<int> notifyFD,
-				HTTPPoster& httpPoster) :
-					httpPoster(httpPoster),
-					acceptor(ioService, tcp::endpoint(bindAddress, port)),
-					socket(ioService) {
-			doAccept();
-			if (notifyFD) {
-				auto writeResult = write(*notifyFD, "\n", 1);
-				if (writeResult <= 0) { LOG(error) << "Error " << writeResult << " writing to descriptor " << *notifyFD; }
-				auto closeResult = close(*notifyFD);
-				if (closeResult < 0) { LOG(error) << "Error " << closeResult << " closing descriptor " << *notifyFD; }
+		static void sendFileDescriptors(int socket, const std::vector<int>& fds) {
+			char byte = 0;
+			iovec iov = { &byte, 1 };
+			std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+			msghdr msg = {};
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control.data();
+			msg.msg_controllen = control.size();
+			cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+			std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+			if (sendmsg(socket, &msg, 0) < 0) {
+				throw std::runtime_error(std::string("Unable to send listening socket: ") + strerror(errno));
 			}
-			LOG(info) << "Listening for SMTP connections on " << tcp::endpoint(bindAddress, port);
 		}
 
-	private:
-		void doAccept() {
-			acceptor.async_accept(socket, [this](boost::system::error_code ec) {
-				if (!ec) {
-					std::make_shared<Session>(std::move(socket), httpPoster)->start();
+		static std::vector<int> receiveFileDescriptors(int socket) {
+			static const size_t maxFDs = 64;
+			char byte;
+			iovec iov = { &byte, 1 };
+			std::vector<char> control(CMSG_SPACE(sizeof(int) * maxFDs));
+			msghdr msg = {};
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control.data();
+			msg.msg_controllen = control.size();
+			ssize_t result;
+			do {
+				result = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+			} while (result < 0 && errno == EINTR);
+			if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				throw std::runtime_error("Timed out receiving listening socket from running process");
+			}
+			if (result <= 0) {
+				throw std::runtime_error("Unable to receive listening socket from running process");
+			}
+			std::vector<int> fds;
+			for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+				if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+					size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+					fds.resize(count);
+					std::memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * count);
 				}
-				doAccept();
-			});
+			}
+			if (fds.empty()) {
+				throw std::runtime_error("Running process didn't send a listening socket");
+			}
+			return fds;
 		}
 
-		HTTPPoster& httpPoster;
-		tcp::acceptor acceptor;
-		tcp::socket socket;
+		boost::asio::io_service& ioService;
+		std::string path;
+		local::stream_protocol::acceptor acceptor;
+		local::stream_protocol::socket connection; // To the previous process
+		local::stream_protocol::socket handoff; // To the next process
+		int timeout; // Seconds to wait for open connections (0 = no limit)
+		boost::optional<std::chrono::steady_clock::time_point> deadline;
+		boost::asio::steady_timer pollTimer;
+		Server* server;
+		DrainFunction drain;
+		std::unique_ptr<Replay> replay;
 };
 
+// Listening sockets passed by systemd (or another supervisor implementing 
+// its socket activation protocol).
+static std::vector<int> getSocketActivationFDs() {
+	static const int firstFD = 3; // SD_LISTEN_FDS_START
+	std::vector<int> fds;
+	const char* pid = getenv("LISTEN_PID");
+	const char* count = getenv("LISTEN_FDS");
+	// Like sd_listen_fds(), ignore variables that weren't meant for this 
+	// process (e.g. inherited from a parent that was socket activated)
+	if (!count || !pid || std::atoi(pid) != getpid()) {
+		return fds;
+	}
+	for (int fd = firstFD; fd < firstFD + std::atoi(count); ++fd) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fds.push_back(fd);
+	}
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	return fds;
+}
+
+// The unit tests include this file, and have a main() of their own
+#ifndef UNITTESTS
 int main(int argc, char* argv[]) {
+	// Writes to closed sockets, pipes and exited exec workers fail with EPIPE 
+	// instead of killing the process, whichever sink is used
+	signal(SIGPIPE, SIG_IGN);
 	curl_global_init(CURL_GLOBAL_ALL);
 
+	boost::shared_ptr<LogSink> logSink;
 	try {
 		int port;
-		std::string httpURL;
+		int tlsPort = 0;
+		size_t maxConnections;
+		size_t maxConnectionsPerIP;
+		std::vector<std::string> httpURLs;
 		std::vector<std::string> httpHeaders;
+		CompressionOptions compression;
+		HTTPOptions httpOptions;
+		MessageOptions messageOptions;
+		DeduplicationOptions deduplication;
+		FileSinkOptions fileSinkOptions;
+		ExecSinkOptions execSinkOptions;
+		int flapWindow;
 
 		po::options_description options("Allowed options");
 		options.add_options()
@@ -402,10 +6077,62 @@ int main(int argc, char* argv[]) {
 			("verbose", "Enable verbose output")
 			("debug", "Enable debug output")
 			("notify-fd", po::value<int>(), "Write to file descriptor when ready")
+			("io-backend", po::value<std::string>()->default_value(ioBackend), "I/O backend (epoll, io_uring); only the backend this was built with is available")
+			("hot-restart-socket", po::value<std::string>(), "Unix socket to take over the listening socket and undelivered messages of a running process through")
+			("hot-restart-timeout", po::value<int>()->default_value(60), "Seconds to wait for open connections to end before handing over to a new process (0 = no limit)")
 			("bind", po::value<std::string>()->default_value("0.0.0.0"), "SMTP address to bind")
-			("port", po::value<int>(&port)->default_value(25), "SMTP port to bind")
-			("url", po::value<std::string>(&httpURL)->required(), "HTTP URL")
-			("header,H", po::value<std::vector<std::string>>(&httpHeaders), "Extra HTTP Headers");
+			("port", po::value<int>(&port)->default_value(25), "SMTP port to bind (0 = none)")
+#ifdef HAVE_OPENSSL
+			("tls-port", po::value<int>(&tlsPort)->default_value(0), "SMTP port to bind for implicit TLS (e.g. 465; 0 = none)")
+			("tls-cert", po::value<std::string>(), "TLS certificate chain (PEM) for STARTTLS and implicit TLS")
+			("tls-key", po::value<std::string>(), "TLS private key (PEM)")
+#endif
+			("listen", po::value<std::vector<std::string>>(), "Additional endpoint to accept SMTP connections on: unix:PATH (can be repeated)")
+			("listen-fd", po::value<std::vector<int>>(), "Inherited listening socket to accept SMTP connections on instead of binding (can be repeated)")
+			("max-connections", po::value<size_t>(&maxConnections)->default_value(0), "Maximum number of concurrent SMTP connections (0 = unlimited)")
+			("max-connections-per-ip", po::value<size_t>(&maxConnectionsPerIP)->default_value(0), "Maximum number of concurrent SMTP connections per client address (0 = unlimited)")
+			("sink", po::value<std::string>()->default_value("http"), "Where to deliver messages (http, file, ring, exec)")
+			("url", po::value<std::vector<std::string>>(&httpURLs), "HTTP URL (can be repeated to balance between several URLs)")
+			("unix-socket", po::value<std::string>(&httpOptions.unixSocket), "Unix socket to connect to for all HTTP requests, instead of the host of the URL")
+			("header,H", po::value<std::vector<std::string>>(&httpHeaders), "Extra HTTP Headers")
+			("routes", po::value<std::string>(), "JSON file with URLs to use for specific recipients")
+			("lanes", po::value<std::string>(), "JSON file with priority lanes to share HTTP requests between")
+			("parse-mime", "Add the headers, text, HTML and attachments of the (MIME) message to the request")
+			("parse-haproxy-alerts", "Add the fields of HAProxy email alerts to the request")
+			("haproxy-sender", po::value<std::string>(&messageOptions.haproxySender), "Sender address of HAProxy email alerts (default: recognize alerts by subject)")
+			("haproxy-flap-window", po::value<int>(&flapWindow)->default_value(0), "Post a summary of the HAProxy alerts of each server every this many seconds, instead of every alert (0 = disabled)")
+			("spill-size", po::value<size_t>(&messageOptions.spillSize)->default_value(0), "Store message data and attachments larger than this on disk, and post them as multipart/form-data (0 = never)")
+			("spill-dir", po::value<std::string>(&messageOptions.spillDirectory)->default_value("/tmp"), "Directory for temporary files of large messages")
+			("http-engine", po::value<std::string>()->default_value("curl"), "HTTP client to post with (curl, asio); asio runs on the SMTP event loop, but only supports http URLs")
+			("http2", "Use HTTP/2 (ALPN for https, prior knowledge for http) and multiplex requests")
+			("http-max-connections", po::value<long>(&httpOptions.maxConnections)->default_value(1), "Maximum number of concurrent HTTP connections")
+			("http2-max-streams", po::value<long>(&httpOptions.maxStreams)->default_value(100), "Maximum number of concurrent HTTP/2 streams per connection")
+			("balance", po::value<std::string>()->default_value("least-outstanding"), "How to balance between URLs (least-outstanding, latency)")
+			("eject-after-failures", po::value<int>(&httpOptions.ejectAfterFailures)->default_value(3), "Stop using a URL after this many consecutive failures")
+			("eject-seconds", po::value<int>(&httpOptions.ejectSeconds)->default_value(30), "How long to stop using a failing URL")
+			("health-check-path", po::value<std::string>(&httpOptions.healthCheckPath), "Path to periodically GET on each URL's host to check its health")
+			("health-check-interval", po::value<int>(&httpOptions.healthCheckInterval)->default_value(10), "Seconds between health checks")
+			("fan-out", po::value<std::string>()->default_value("route"), "Post a message once per route or once per recipient (route, recipient)")
+			("dedup-window", po::value<int>(&deduplication.window)->default_value(0), "Suppress identical messages received within this many seconds (0 = disabled)")
+			("dedup-ignore-header", po::value<std::vector<std::string>>(&deduplication.ignoredHeaders), "Header to ignore when comparing messages (default: Date and Message-ID)")
+			("dedup-max-entries", po::value<size_t>(&deduplication.maxEntries)->default_value(10000), "Maximum number of messages to remember for deduplication")
+			("compress", po::value<std::string>(), "Compress HTTP request bodies (gzip, zstd)")
+			("compress-level", po::value<int>(), "Compression level")
+			("compress-min-size", po::value<size_t>(&compression.minSize)->default_value(1024), "Minimum request body size to compress")
+			("file-path", po::value<std::string>(&fileSinkOptions.path), "File to append messages to as JSON lines (with --sink=file)")
+			("file-sync", po::value<std::string>()->default_value("never"), "When to flush the file to disk (never, batch, interval)")
+			("file-sync-interval", po::value<int>(&fileSinkOptions.syncInterval)->default_value(1), "Seconds between flushes of the file (with --file-sync=interval)")
+			("file-max-size", po::value<size_t>(&fileSinkOptions.maxSize)->default_value(0), "Rotate the file before it grows beyond this many bytes (0 = never)")
+			("file-rotate-seconds", po::value<int>(&fileSinkOptions.rotateSeconds)->default_value(0), "Rotate the file after this many seconds (0 = never)")
+			("ring-path", po::value<std::string>(), "Shared memory file to publish messages to (with --sink=ring, e.g. /dev/shm/smtp-http-proxy)")
+			("ring-size", po::value<size_t>()->default_value(64 << 20), "Size of the ring buffer in bytes (a power of two)")
+			("exec-command", po::value<std::string>(&execSinkOptions.command), "Command (run with /bin/sh -c) of the worker processes to stream messages to (with --sink=exec)")
+			("exec-workers", po::value<size_t>(&execSinkOptions.workers)->default_value(1), "Number of worker processes")
+			("exec-dispatch", po::value<std::string>()->default_value("least-loaded"), "How to spread messages over the workers (least-loaded, round-robin)")
+			("exec-max-outstanding", po::value<size_t>(&execSinkOptions.maxOutstanding)->default_value(16), "Maximum number of unacknowledged messages per worker")
+			("exec-max-attempts", po::value<size_t>(&execSinkOptions.maxAttempts)->default_value(3), "Number of workers a message is given to before it is dropped, when they exit without acknowledging it")
+			("exec-stop-timeout", po::value<int>(&execSinkOptions.stopTimeout)->default_value(10), "Seconds to wait for workers to exit on shutdown before killing them")
+			("log-max-payload", po::value<size_t>(&maxLogPayload)->default_value(1024), "Maximum number of bytes of message data to log (0 = unlimited)");
 		po::variables_map vm;
 		po::store(po::parse_command_line(argc, argv, options), vm);
 		if (vm.count("help")) {
@@ -415,7 +6142,11 @@ int main(int argc, char* argv[]) {
 		po::notify(vm);    
 
 		boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
-		boost::log::add_console_log(std::clog, boost::log::keywords::format = "[%TimeStamp%] %Message%");
+		logSink = boost::make_shared<LogSink>();
+		logSink->locked_backend()->add_stream(boost::shared_ptr<std::ostream>(&std::clog, boost::null_deleter()));
+		logSink->locked_backend()->auto_flush(true);
+		logSink->set_formatter(boost::log::parse_formatter("[%TimeStamp%] %Message%"));
+		boost::log::core::get()->add_sink(logSink);
 		boost::log::add_common_attributes();
 
 		boost::optional<int> notifyFD;
@@ -429,24 +6160,240 @@ int main(int argc, char* argv[]) {
 		}
 		if (vm.count("debug")) {
 			boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::debug);
+#ifdef DISABLE_TRACE
+			LOG(warning) << "Debug tracing is not available in this build";
+#else
+			traceEnabled = true;
+#endif
 		}
 		if (vm.count("notify-fd")) {
 			notifyFD = vm["notify-fd"].as<int>();
 		}
+		auto backend = vm["io-backend"].as<std::string>();
+		if (backend != ioBackend) {
+			throw po::error("I/O backend " + backend + " is not available in this build (using " + ioBackend + ")");
+		}
+		LOG(info) << "Using " << ioBackend << " I/O backend";
+		if (vm.count("http2")) {
+			httpOptions.http2 = true;
+		}
+		if (vm.count("parse-mime")) {
+			messageOptions.parseMIME = true;
+		}
+		if (vm.count("parse-haproxy-alerts") || flapWindow > 0) {
+			messageOptions.parseHAProxyAlerts = true;
+		}
+		if (deduplication.ignoredHeaders.empty()) {
+			deduplication.ignoredHeaders = {"Date", "Message-ID"};
+		}
+		if (deduplication.maxEntries == 0) {
+			throw po::invalid_option_value("0");
+		}
+		if (messageOptions.spillSize > 0) {
+			// Fail early if the directory isn't usable
+			SpillFile check(messageOptions.spillDirectory);
+		}
+		auto balance = vm["balance"].as<std::string>();
+		if (balance == "latency") {
+			httpOptions.balancing = HTTPOptions::LatencyEWMA;
+		}
+		else if (balance != "least-outstanding") {
+			throw po::invalid_option_value(balance);
+		}
+		auto sinkType = vm["sink"].as<std::string>();
+		if (sinkType == "http") {
+			if (httpURLs.empty()) {
+				throw po::required_option("--url");
+			}
+		}
+		else if (sinkType == "file") {
+			if (fileSinkOptions.path.empty()) {
+				throw po::required_option("--file-path");
+			}
+		}
+		else if (sinkType == "ring") {
+			if (!vm.count("ring-path")) {
+				throw po::required_option("--ring-path");
+			}
+		}
+		else if (sinkType == "exec") {
+			if (execSinkOptions.command.empty()) {
+				throw po::required_option("--exec-command");
+			}
+			if (execSinkOptions.workers == 0 || execSinkOptions.maxOutstanding == 0) {
+				throw po::invalid_option_value("0");
+			}
+		}
+		else {
+			throw po::invalid_option_value(sinkType);
+		}
+		if (execSinkOptions.maxAttempts == 0) {
+			throw po::invalid_option_value("0");
+		}
+		auto execDispatch = vm["exec-dispatch"].as<std::string>();
+		if (execDispatch == "round-robin") {
+			execSinkOptions.dispatch = ExecSinkOptions::RoundRobin;
+		}
+		else if (execDispatch != "least-loaded") {
+			throw po::invalid_option_value(execDispatch);
+		}
+		auto fileSync = vm["file-sync"].as<std::string>();
+		if (fileSync == "batch") {
+			fileSinkOptions.sync = FileSinkOptions::Batch;
+		}
+		else if (fileSync == "interval") {
+			fileSinkOptions.sync = FileSinkOptions::Interval;
+		}
+		else if (fileSync != "never") {
+			throw po::invalid_option_value(fileSync);
+		}
+		auto httpEngine = vm["http-engine"].as<std::string>();
+		if (httpEngine != "curl" && httpEngine != "asio") {
+			throw po::invalid_option_value(httpEngine);
+		}
+		auto fanOut = vm["fan-out"].as<std::string>();
+		if (fanOut == "recipient") {
+			httpOptions.fanOut = HTTPOptions::PerRecipient;
+		}
+		else if (fanOut != "route") {
+			throw po::invalid_option_value(fanOut);
+		}
+		if (vm.count("compress")) {
+			auto method = vm["compress"].as<std::string>();
+			int minLevel, maxLevel;
+			if (method == "gzip") {
+				compression.method = CompressionOptions::Gzip;
+				minLevel = Z_NO_COMPRESSION;
+				maxLevel = Z_BEST_COMPRESSION;
+			}
+#ifdef HAVE_ZSTD
+			else if (method == "zstd") {
+				compression.method = CompressionOptions::Zstd;
+				minLevel = ZSTD_minCLevel();
+				maxLevel = ZSTD_maxCLevel();
+			}
+#endif
+			else {
+				throw po::invalid_option_value(method);
+			}
+			if (vm.count("compress-level")) {
+				compression.level = vm["compress-level"].as<int>();
+				if (*compression.level < minLevel || *compression.level > maxLevel) {
+					throw po::error("--compress-level must be between " + std::to_string(minLevel) + " and " + std::to_string(maxLevel) + " for " + method);
+				}
+			}
+		}
 
 		boost::asio::io_service io_service;
 
-		HTTPPoster httpPoster(httpURL, httpHeaders);
+		std::unique_ptr<TLSContext> tlsContext;
+#ifdef HAVE_OPENSSL
+		if (vm.count("tls-cert") || vm.count("tls-key")) {
+			if (!vm.count("tls-cert") || !vm.count("tls-key")) {
+				throw po::error("--tls-cert and --tls-key must be given together");
+			}
+			tlsContext.reset(new TLSContext(vm["tls-cert"].as<std::string>(), vm["tls-key"].as<std::string>()));
+		}
+#endif
+
+		std::vector<int> listenFDs = getSocketActivationFDs();
+		if (vm.count("listen-fd")) {
+			auto fds = vm["listen-fd"].as<std::vector<int>>();
+			listenFDs.insert(listenFDs.end(), fds.begin(), fds.end());
+		}
+		std::vector<std::string> unixPaths;
+		if (vm.count("listen")) {
+			for (const auto& endpoint : vm["listen"].as<std::vector<std::string>>()) {
+				if (!boost::algorithm::starts_with(endpoint, "unix:") || endpoint.size() == 5) {
+					throw po::invalid_option_value(endpoint);
+				}
+				unixPaths.push_back(endpoint.substr(5));
+			}
+		}
+		if (!listenFDs.empty() && !unixPaths.empty()) {
+			throw po::error("--listen can't be combined with inherited listening sockets (LISTEN_FDS or --listen-fd); inherit the Unix sockets as well");
+		}
+		std::unique_ptr<HotRestart> hotRestart;
+		if (vm.count("hot-restart-socket")) {
+			hotRestart.reset(new HotRestart(io_service, vm["hot-restart-socket"].as<std::string>(), vm["hot-restart-timeout"].as<int>()));
+			auto fds = hotRestart->takeOver();
+			if (!fds.empty()) {
+				for (int fd : listenFDs) {
+					close(fd);
+				}
+				listenFDs = fds;
+			}
+		}
+		if (listenFDs.empty() && port <= 0 && !(tlsContext && tlsPort > 0) && unixPaths.empty()) {
+			throw po::error("Nothing to listen on: give a --port, --tls-port, --listen or --listen-fd");
+		}
+
+		RoutingTable routingTable(httpURLs);
+		if (vm.count("routes")) {
+			routingTable.load(vm["routes"].as<std::string>());
+		}
+
+		PriorityLanes lanes;
+		if (vm.count("lanes")) {
+			lanes.load(vm["lanes"].as<std::string>());
+		}
+
+		std::unique_ptr<MessageSink> sink;
+		if (sinkType == "file") {
+			sink.reset(new FileSink(fileSinkOptions));
+		}
+		else if (sinkType == "exec") {
+			sink.reset(new ExecSink(io_service, lanes, execSinkOptions));
+		}
+		else if (sinkType == "ring") {
+			sink.reset(new RingSink(io_service, vm["ring-path"].as<std::string>(), vm["ring-size"].as<size_t>()));
+		}
+		else if (httpEngine == "asio") {
+			sink.reset(new AsioHTTPPoster(io_service, routingTable, lanes, httpHeaders, compression, httpOptions));
+		}
+		else {
+			sink.reset(new HTTPPoster(routingTable, lanes, httpHeaders, compression, httpOptions));
+		}
+		SMTPHandler* handler = sink.get();
+		std::unique_ptr<Deduplicator> deduplicator;
+		if (deduplication.window > 0) {
+			deduplicator.reset(new Deduplicator(io_service, *sink, deduplication));
+			handler = deduplicator.get();
+		}
+		std::unique_ptr<FlapAggregator> flapAggregator;
+		if (flapWindow > 0) {
+			flapAggregator.reset(new FlapAggregator(io_service, *handler, flapWindow));
+			handler = flapAggregator.get();
+		}
 		Server s(
 				io_service, 
 				bindAddress,
 				port,
+				tlsPort,
+				tlsContext.get(),
+				listenFDs,
+				unixPaths,
 				notifyFD,
-				httpPoster
+				maxConnections,
+				maxConnectionsPerIP,
+				*handler,
+				routingTable,
+				messageOptions
 		);
+		if (hotRestart) {
+			hotRestart->start(s, *sink, routingTable, messageOptions, [&](MessageSink::DrainHandler drained) {
+				if (flapAggregator) {
+					flapAggregator->flush();
+				}
+				if (deduplicator) {
+					deduplicator->flush();
+				}
+				sink->drain(drained);
+			});
+		}
 		io_service.run();
 
-		httpPoster.stop();
+		sink->stop();
 
 	}
 	catch (boost::program_options::error& e) {
@@ -455,4 +6402,14 @@ int main(int argc, char* argv[]) {
 	catch (std::exception& e) {
 		LOG(fatal) << "Exception: " << e.what() << "\n";
 	}
+
+	if (logSink) {
+		boost::log::core::get()->remove_sink(logSink);
+		logSink->stop();
+		logSink->flush();
+		if (droppedLogRecords > 0) {
+			std::clog << "Dropped " << droppedLogRecords << " log records" << std::endl;
+		}
+	}
 }
+#endif
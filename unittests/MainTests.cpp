@@ -0,0 +1,821 @@
+#include "catch.hpp"
+
+#define UNITTESTS
+#include "../main.cpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// HTTPResponseParser
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+	struct ParsedResponse {
+		bool complete;
+		int status;
+		bool keepAlive;
+	};
+
+	ParsedResponse parseResponse(const std::vector<std::string>& pieces) {
+		HTTPResponseParser parser;
+		for (const auto& piece : pieces) {
+			parser.parse(piece.data(), piece.size());
+		}
+		return { parser.isComplete(), parser.getStatus(), parser.isKeepAlive() };
+	}
+
+	// Parses the response whole, split in two at every byte boundary, and
+	// byte by byte, and checks that all give the same result.
+	ParsedResponse parseSplit(const std::string& response) {
+		ParsedResponse whole = parseResponse({response});
+		for (size_t i = 0; i <= response.size(); ++i) {
+			ParsedResponse split = parseResponse({response.substr(0, i), response.substr(i)});
+			INFO("Split at " << i);
+			CHECK(split.complete == whole.complete);
+			CHECK(split.status == whole.status);
+			CHECK(split.keepAlive == whole.keepAlive);
+		}
+		std::vector<std::string> bytes;
+		for (char c : response) {
+			bytes.push_back(std::string(1, c));
+		}
+		ParsedResponse byByte = parseResponse(bytes);
+		CHECK(byByte.complete == whole.complete);
+		CHECK(byByte.status == whole.status);
+		CHECK(byByte.keepAlive == whole.keepAlive);
+		return whole;
+	}
+}
+
+TEST_CASE("HTTPResponseParser parses a Content-Length body", "[HTTPResponseParser]") {
+	auto response = parseSplit("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello");
+	CHECK(response.complete);
+	CHECK(response.status == 200);
+	CHECK(response.keepAlive);
+}
+
+TEST_CASE("HTTPResponseParser does not complete a truncated body", "[HTTPResponseParser]") {
+	auto response = parseSplit("HTTP/1.1 200 OK\r\nContent-Length: 6\r\n\r\nhello");
+	CHECK(!response.complete);
+}
+
+TEST_CASE("HTTPResponseParser parses a chunked body with trailers", "[HTTPResponseParser]") {
+	auto response = parseSplit(
+			"HTTP/1.1 201 Created\r\nTransfer-Encoding: chunked\r\n\r\n"
+			"5\r\nhello\r\n"
+			"7;ext=1\r\n, world\r\n"
+			"0\r\nX-Checksum: abc\r\nX-Other: def\r\n\r\n");
+	CHECK(response.complete);
+	CHECK(response.status == 201);
+	CHECK(response.keepAlive);
+}
+
+TEST_CASE("HTTPResponseParser does not complete a chunked body before its trailers end", "[HTTPResponseParser]") {
+	auto response = parseSplit("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\nX-Checksum: abc\r\n");
+	CHECK(!response.complete);
+}
+
+TEST_CASE("HTTPResponseParser skips 100 Continue", "[HTTPResponseParser]") {
+	auto response = parseSplit("HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+	CHECK(response.complete);
+	CHECK(response.status == 200);
+	CHECK(response.keepAlive);
+}
+
+TEST_CASE("HTTPResponseParser completes 204 and 304 without a body", "[HTTPResponseParser]") {
+	auto noContent = parseSplit("HTTP/1.1 204 No Content\r\nContent-Length: 10\r\n\r\n");
+	CHECK(noContent.complete);
+	CHECK(noContent.status == 204);
+	CHECK(noContent.keepAlive);
+
+	auto notModified = parseSplit("HTTP/1.1 304 Not Modified\r\nTransfer-Encoding: chunked\r\n\r\n");
+	CHECK(notModified.complete);
+	CHECK(notModified.status == 304);
+	CHECK(notModified.keepAlive);
+}
+
+TEST_CASE("HTTPResponseParser closes HTTP/1.0 connections unless kept alive", "[HTTPResponseParser]") {
+	auto plain = parseSplit("HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\nok");
+	CHECK(plain.complete);
+	CHECK(!plain.keepAlive);
+
+	auto keepAlive = parseSplit("HTTP/1.0 200 OK\r\nConnection: Keep-Alive\r\nContent-Length: 2\r\n\r\nok");
+	CHECK(keepAlive.complete);
+	CHECK(keepAlive.keepAlive);
+}
+
+TEST_CASE("HTTPResponseParser honours Connection: close", "[HTTPResponseParser]") {
+	auto response = parseSplit("HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 2\r\n\r\nok");
+	CHECK(response.complete);
+	CHECK(!response.keepAlive);
+}
+
+TEST_CASE("HTTPResponseParser reads a body without length until the connection closes", "[HTTPResponseParser]") {
+	HTTPResponseParser parser;
+	std::string response = "HTTP/1.1 200 OK\r\n\r\nsome body";
+	parser.parse(response.data(), response.size());
+	CHECK(!parser.isComplete());
+	CHECK(!parser.isKeepAlive());
+	CHECK(parser.finishAtEOF());
+	CHECK(parser.isComplete());
+}
+
+TEST_CASE("HTTPResponseParser does not finish a length-delimited body at EOF", "[HTTPResponseParser]") {
+	HTTPResponseParser parser;
+	std::string response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhel";
+	parser.parse(response.data(), response.size());
+	CHECK(!parser.finishAtEOF());
+	CHECK(!parser.isComplete());
+}
+
+TEST_CASE("HTTPResponseParser does not keep alive with bytes after the response", "[HTTPResponseParser]") {
+	auto sameRead = parseSplit("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nokHTTP/1.1 200 OK\r\n");
+	CHECK(sameRead.complete);
+	CHECK(sameRead.status == 200);
+	CHECK(!sameRead.keepAlive);
+
+	auto chunked = parseSplit("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\nx");
+	CHECK(chunked.complete);
+	CHECK(!chunked.keepAlive);
+}
+
+TEST_CASE("HTTPResponseParser rejects malformed responses", "[HTTPResponseParser]") {
+	HTTPResponseParser parser;
+	std::string badStatus = "HTTP/2 200\r\n";
+	CHECK_THROWS(parser.parse(badStatus.data(), badStatus.size()));
+
+	parser.reset();
+	std::string badHeader = "HTTP/1.1 200 OK\r\nno colon\r\n";
+	CHECK_THROWS(parser.parse(badHeader.data(), badHeader.size()));
+
+	parser.reset();
+	std::string badChunk = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nxyz\r\n";
+	CHECK_THROWS(parser.parse(badChunk.data(), badChunk.size()));
+
+	parser.reset();
+	std::string longLine = "HTTP/1.1 200 OK\r\nX-Long: " + std::string(10000, 'a');
+	CHECK_THROWS(parser.parse(longLine.data(), longLine.size()));
+}
+
+TEST_CASE("HTTPResponseParser can be reused after reset", "[HTTPResponseParser]") {
+	HTTPResponseParser parser;
+	CHECK(!parser.hasStarted());
+	std::string first = "HTTP/1.1 500 Error\r\nContent-Length: 0\r\n\r\n";
+	parser.parse(first.data(), first.size());
+	CHECK(parser.hasStarted());
+	CHECK(parser.isComplete());
+	CHECK(parser.getStatus() == 500);
+
+	parser.reset();
+	CHECK(!parser.hasStarted());
+	CHECK(!parser.isComplete());
+	std::string second = "HTTP/1.1 202 Accepted\r\nContent-Length: 0\r\n\r\n";
+	parser.parse(second.data(), second.size());
+	CHECK(parser.isComplete());
+	CHECK(parser.getStatus() == 202);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MIMEParser, Base64Decoder, decodeQuotedPrintable
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+	std::shared_ptr<const MIMEContent> parseMIME(const std::string& message, const MessageOptions& options = MessageOptions()) {
+		MIMEParser parser(options);
+		std::vector<std::string> lines;
+		boost::algorithm::split(lines, message, boost::algorithm::is_any_of("\n"));
+		if (!lines.empty() && lines.back().empty()) {
+			lines.pop_back();
+		}
+		for (const auto& line : lines) {
+			parser.receive(line);
+		}
+		return parser.finish();
+	}
+
+	std::string decodeBase64(const std::string& data) {
+		std::string result;
+		Base64Decoder().decode(data.data(), data.size(), result);
+		return result;
+	}
+
+	std::string decodeQuotedPrintableLines(const std::vector<std::string>& lines) {
+		std::string result;
+		for (const auto& line : lines) {
+			decodeQuotedPrintable(line, result);
+		}
+		return result;
+	}
+}
+
+TEST_CASE("Base64Decoder decodes", "[MIMEParser]") {
+	CHECK(decodeBase64("") == "");
+	CHECK(decodeBase64("aGVsbG8gd29ybGQ=") == "hello world");
+	CHECK(decodeBase64("aGVsbG8gd29ybA==") == "hello worl");
+	CHECK(decodeBase64("aGVsbG8gd29y") == "hello wor");
+}
+
+TEST_CASE("Base64Decoder decodes input split at every position", "[MIMEParser]") {
+	std::string encoded = "VGhlIHF1aWNrIGJyb3duIGZveA==";
+	for (size_t i = 0; i <= encoded.size(); ++i) {
+		INFO("Split at " << i);
+		Base64Decoder decoder;
+		std::string result;
+		decoder.decode(encoded.data(), i, result);
+		decoder.decode(encoded.data() + i, encoded.size() - i, result);
+		CHECK(result == "The quick brown fox");
+	}
+}
+
+TEST_CASE("Base64Decoder skips line breaks and invalid characters", "[MIMEParser]") {
+	CHECK(decodeBase64("aGVs\r\nbG8=") == "hello");
+	CHECK(decodeBase64("aGVs!bG8=") == "hello");
+	CHECK(decodeBase64("a G V s b G 8 =") == "hello");
+	CHECK(decodeBase64("!!!!") == "");
+}
+
+TEST_CASE("Base64Decoder handles padding only", "[MIMEParser]") {
+	CHECK(decodeBase64("=") == "");
+	CHECK(decodeBase64("====") == "");
+	CHECK(decodeBase64("aGk=====") == "hi");
+}
+
+TEST_CASE("decodeQuotedPrintable decodes escapes", "[MIMEParser]") {
+	CHECK(decodeQuotedPrintableLines({"caf=C3=A9 =3D ok"}) == "caf\xc3\xa9 = ok\n");
+	CHECK(decodeQuotedPrintableLines({"lower =c3=a9"}) == "lower \xc3\xa9\n");
+}
+
+TEST_CASE("decodeQuotedPrintable joins soft line breaks", "[MIMEParser]") {
+	CHECK(decodeQuotedPrintableLines({"Hello=", " world=  ", "!"}) == "Hello world!\n");
+	CHECK(decodeQuotedPrintableLines({"one", "two"}) == "one\ntwo\n");
+}
+
+TEST_CASE("decodeQuotedPrintable keeps invalid escapes and strips trailing whitespace", "[MIMEParser]") {
+	CHECK(decodeQuotedPrintableLines({"=ZZ=4"}) == "=ZZ=4\n");
+	CHECK(decodeQuotedPrintableLines({"100%=", ""}) == "100%\n");
+	CHECK(decodeQuotedPrintableLines({"trailing \t "}) == "trailing\n");
+}
+
+TEST_CASE("MIMEParser parses a plain message", "[MIMEParser]") {
+	auto content = parseMIME("Subject: hello\nFrom: a@b\n\nline 1\nline 2\n");
+	REQUIRE(content->headers.size() == 2);
+	CHECK(content->headers[0].first == "Subject");
+	CHECK(content->headers[0].second == "hello");
+	CHECK(content->text == "line 1\nline 2\n");
+	CHECK(content->html == "");
+	CHECK(content->attachments.empty());
+}
+
+TEST_CASE("MIMEParser parses nested multiparts", "[MIMEParser]") {
+	auto content = parseMIME(
+			"Subject: nested\n"
+			"Content-Type: multipart/mixed; boundary=outer\n"
+			"\n"
+			"preamble\n"
+			"--outer\n"
+			"Content-Type: multipart/alternative; boundary=\"inner\"\n"
+			"\n"
+			"--inner\n"
+			"Content-Type: text/plain\n"
+			"\n"
+			"plain text\n"
+			"--inner\n"
+			"Content-Type: text/html\n"
+			"Content-Transfer-Encoding: quoted-printable\n"
+			"\n"
+			"<p>html=3D</p>\n"
+			"--inner--\n"
+			"--outer\n"
+			"Content-Type: application/octet-stream\n"
+			"Content-Disposition: attachment; filename=\"a.bin\"\n"
+			"Content-Transfer-Encoding: base64\n"
+			"\n"
+			"aGVsbG8g\n"
+			"d29ybGQ=\n"
+			"--outer--\n"
+			"epilogue\n");
+	CHECK(content->headers[0].second == "nested");
+	CHECK(content->text == "plain text\n");
+	CHECK(content->html == "<p>html=</p>\n");
+	REQUIRE(content->attachments.size() == 1);
+	CHECK(content->attachments[0].filename == "a.bin");
+	CHECK(content->attachments[0].contentType == "application/octet-stream");
+	CHECK(content->attachments[0].size == 11);
+	CHECK(decodeBase64(content->attachments[0].data) == "hello world");
+}
+
+TEST_CASE("MIMEParser closes inner parts on an outer boundary", "[MIMEParser]") {
+	auto content = parseMIME(
+			"Content-Type: multipart/mixed; boundary=outer\n"
+			"\n"
+			"--outer\n"
+			"Content-Type: multipart/alternative; boundary=inner\n"
+			"\n"
+			"--inner\n"
+			"\n"
+			"first\n"
+			"--outer\n"
+			"\n"
+			"second\n"
+			"--outer--\n");
+	CHECK(content->text == "first\nsecond\n");
+}
+
+TEST_CASE("MIMEParser handles boundaries split across header lines", "[MIMEParser]") {
+	auto content = parseMIME(
+			"Content-Type: multipart/mixed;\n"
+			"\tboundary=\"folded\"\n"
+			"\n"
+			"--folded  \n"
+			"\n"
+			"text\n"
+			"--foldedX\n"
+			"--folded--\n");
+	CHECK(content->text == "text\n--foldedX\n");
+}
+
+TEST_CASE("MIMEParser computes the size of padding-only and invalid base64 attachments", "[MIMEParser]") {
+	auto content = parseMIME(
+			"Content-Type: multipart/mixed; boundary=b\n"
+			"\n"
+			"--b\n"
+			"Content-Disposition: attachment; filename=pad\n"
+			"Content-Transfer-Encoding: base64\n"
+			"\n"
+			"====\n"
+			"--b\n"
+			"Content-Disposition: attachment; filename=short\n"
+			"Content-Transfer-Encoding: base64\n"
+			"\n"
+			"=\n"
+			"--b\n"
+			"Content-Disposition: attachment; filename=empty\n"
+			"Content-Transfer-Encoding: base64\n"
+			"\n"
+			"--b--\n");
+	REQUIRE(content->attachments.size() == 3);
+	CHECK(content->attachments[0].size == 0);
+	CHECK(content->attachments[1].size == 0);
+	CHECK(content->attachments[2].size == 0);
+}
+
+TEST_CASE("MIMEParser decodes spilled attachments", "[MIMEParser]") {
+	MessageOptions options;
+	options.spillSize = 16;
+	std::string encoded = encodeBase64(std::string(100, 'x'));
+	auto content = parseMIME(
+			"Content-Type: multipart/mixed; boundary=b\n"
+			"\n"
+			"--b\n"
+			"Content-Disposition: attachment; filename=big\n"
+			"Content-Transfer-Encoding: base64\n"
+			"\n"
+			+ encoded.substr(0, 40) + "\n"
+			+ encoded.substr(40) + "\n"
+			"--b--\n", options);
+	REQUIRE(content->attachments.size() == 1);
+	REQUIRE(content->attachments[0].file);
+	CHECK(content->attachments[0].size == 100);
+	CHECK(content->attachments[0].file->readAll() == std::string(100, 'x'));
+}
+
+TEST_CASE("MIMEParser treats a missing closing boundary as the end of the part", "[MIMEParser]") {
+	auto content = parseMIME(
+			"Content-Type: multipart/mixed; boundary=b\n"
+			"\n"
+			"--b\n"
+			"Content-Disposition: attachment; filename=a.txt\n"
+			"\n"
+			"unterminated\n");
+	REQUIRE(content->attachments.size() == 1);
+	CHECK(content->attachments[0].size == 13);
+	CHECK(decodeBase64(content->attachments[0].data) == "unterminated\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// RoutingTable
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+	// Loads the routes (as JSON) through a temporary file
+	void loadRoutes(RoutingTable& table, const std::string& routes) {
+		char path[] = "/tmp/smtp-http-proxy-routes.XXXXXX";
+		int fd = mkstemp(path);
+		REQUIRE(fd >= 0);
+		REQUIRE(write(fd, routes.data(), routes.size()) == static_cast<ssize_t>(routes.size()));
+		close(fd);
+		try {
+			table.load(path);
+		}
+		catch (...) {
+			unlink(path);
+			throw;
+		}
+		unlink(path);
+	}
+
+	size_t resolveRoute(const RoutingTable& table, const std::string& recipient) {
+		return table.resolve(recipient).index;
+	}
+}
+
+TEST_CASE("RoutingTable uses the default route without rules", "[RoutingTable]") {
+	RoutingTable table({"http://default/"});
+	CHECK(resolveRoute(table, "<ops@example.com>") == 0);
+	CHECK(table.resolve("ops@example.com").urls == std::vector<std::string>({"http://default/"}));
+}
+
+TEST_CASE("RoutingTable prefers the most specific rule", "[RoutingTable]") {
+	RoutingTable table({"http://default/"});
+	loadRoutes(table, R"({"routes": [
+		{"recipients": ["*"], "url": "http://any/"},
+		{"recipients": ["*.example.com"], "url": "http://subdomains/"},
+		{"recipients": ["example.com"], "url": "http://domain/"},
+		{"recipients": ["ops@example.com", "ops@mail.example.com"], "url": "http://address/"},
+		{"recipients": ["*.eu.example.com"], "url": "http://eu/"},
+		{"recipients": ["mail.eu.example.com"], "url": ["http://eu-mail-1/", "http://eu-mail-2/"], "headers": ["X-Region: eu"]}
+	]})");
+	REQUIRE(table.getRoutes().size() == 7);
+
+	CHECK(resolveRoute(table, "<ops@example.com>") == 4);
+	CHECK(resolveRoute(table, "<ops@mail.example.com>") == 4);
+	CHECK(resolveRoute(table, "<dev@example.com>") == 3);
+	CHECK(resolveRoute(table, "<dev@mail.example.com>") == 2);
+	CHECK(resolveRoute(table, "<dev@a.b.example.com>") == 2);
+	CHECK(resolveRoute(table, "<dev@eu.example.com>") == 2);
+	CHECK(resolveRoute(table, "<dev@x.eu.example.com>") == 5);
+	CHECK(resolveRoute(table, "<dev@mail.eu.example.com>") == 6);
+	CHECK(resolveRoute(table, "<dev@x.mail.eu.example.com>") == 5);
+	CHECK(resolveRoute(table, "<dev@example.org>") == 1);
+	CHECK(resolveRoute(table, "<dev@com>") == 1);
+
+	const Route& route = table.resolve("<dev@mail.eu.example.com>");
+	CHECK(route.urls == std::vector<std::string>({"http://eu-mail-1/", "http://eu-mail-2/"}));
+	CHECK(route.headers == std::vector<std::string>({"X-Region: eu"}));
+}
+
+TEST_CASE("RoutingTable ignores case", "[RoutingTable]") {
+	RoutingTable table({"http://default/"});
+	loadRoutes(table, R"({"routes": [
+		{"recipients": ["Ops@Example.COM"], "url": "http://address/"},
+		{"recipients": ["*.EXAMPLE.org"], "url": "http://subdomains/"}
+	]})");
+	CHECK(resolveRoute(table, "<ops@example.com>") == 1);
+	CHECK(resolveRoute(table, "<OPS@EXAMPLE.COM>") == 1);
+	CHECK(resolveRoute(table, "<dev@Mail.Example.Org>") == 2);
+}
+
+TEST_CASE("RoutingTable falls back to the default route for unmatched recipients", "[RoutingTable]") {
+	RoutingTable table({"http://default/"});
+	loadRoutes(table, R"({"routes": [
+		{"recipients": ["ops@example.com"], "url": "http://address/"},
+		{"recipients": ["*.example.org"], "url": "http://subdomains/"},
+		{"recipients": ["a.example.net"], "url": "http://domain/"}
+	]})");
+	CHECK(resolveRoute(table, "<dev@example.com>") == 0);
+	CHECK(resolveRoute(table, "<ops@example.com.evil>") == 0);
+	CHECK(resolveRoute(table, "<dev@example.org>") == 0);
+	CHECK(resolveRoute(table, "<dev@xexample.org>") == 0);
+	CHECK(resolveRoute(table, "<dev@example.net>") == 0);
+	CHECK(resolveRoute(table, "<dev@b.a.example.net>") == 0);
+	CHECK(resolveRoute(table, "<dev@a.example.net.>") == 0);
+	CHECK(resolveRoute(table, "<dev@>") == 0);
+	CHECK(resolveRoute(table, "<>") == 0);
+	CHECK(resolveRoute(table, "") == 0);
+}
+
+TEST_CASE("RoutingTable extracts the address from envelope recipients", "[RoutingTable]") {
+	CHECK(RoutingTable::getAddress("<ops@example.com> NOTIFY=NEVER") == "ops@example.com");
+	CHECK(RoutingTable::getAddress("  ops@example.com ") == "ops@example.com");
+
+	RoutingTable table({"http://default/"});
+	loadRoutes(table, R"({"routes": [{"recipients": ["ops@example.com"], "url": "http://address/"}]})");
+	CHECK(resolveRoute(table, "<ops@example.com> NOTIFY=NEVER") == 1);
+	CHECK(resolveRoute(table, "ops@example.com") == 1);
+}
+
+TEST_CASE("RoutingTable rejects invalid rules", "[RoutingTable]") {
+	RoutingTable table({"http://default/"});
+	CHECK_THROWS(loadRoutes(table, R"({"routes": [{"recipients": ["a.com"]}]})"));
+	CHECK_THROWS(table.load("/nonexistent/routes.json"));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// HAProxyAlertParser
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+	// An email-alert as sent by HAProxy: the alert is both the subject and
+	// the body.
+	std::string createAlertMessage(const std::string& alert) {
+		return
+				"From: haproxy@example.com\n"
+				"To: ops@example.com\n"
+				"Date: Sat, 17 Oct 2026 10:00:00 +0000\n"
+				"Subject: [HAproxy Alert] " + alert + "\n"
+				"\n"
+				+ alert + "\n";
+	}
+}
+
+TEST_CASE("HAProxyAlertParser parses a DOWN alert", "[HAProxyAlertParser]") {
+	auto alert = HAProxyAlertParser::parse(createAlertMessage(
+			"Server my-backend/mysrv is DOWN, reason: Layer4 timeout, check duration: 2001ms. "
+			"0 active and 1 backup servers left. 3 sessions active, 2 requeued, 0 remaining in queue"), false);
+	REQUIRE(alert);
+	CHECK(alert->proxy == "my-backend");
+	CHECK(alert->server == "mysrv");
+	CHECK(!alert->backupServer);
+	CHECK(alert->state == "DOWN");
+	CHECK(*alert->reason == "Layer4 timeout");
+	CHECK(!alert->code);
+	CHECK(!alert->info);
+	CHECK(*alert->checkDuration == 2001);
+	CHECK(*alert->activeServers == 0);
+	CHECK(*alert->backupServers == 1);
+	CHECK(!alert->runningOnBackup);
+	CHECK(*alert->activeSessions == 3);
+	CHECK(*alert->requeuedSessions == 2);
+	CHECK(*alert->queuedSessions == 0);
+}
+
+TEST_CASE("HAProxyAlertParser parses an UP alert with code and info", "[HAProxyAlertParser]") {
+	auto alert = HAProxyAlertParser::parse(createAlertMessage(
+			"Server be_app/app-2.example.com is UP, reason: Layer7 check passed, code: 200, "
+			"info: \"OK, ready.\", check duration: 3ms. 2 active and 0 backup servers online. "
+			"0 sessions requeued, 0 total in queue"), false);
+	REQUIRE(alert);
+	CHECK(alert->proxy == "be_app");
+	CHECK(alert->server == "app-2.example.com");
+	CHECK(alert->state == "UP");
+	CHECK(*alert->reason == "Layer7 check passed");
+	CHECK(*alert->code == 200);
+	CHECK(*alert->info == "OK, ready.");
+	CHECK(*alert->checkDuration == 3);
+	CHECK(*alert->activeServers == 2);
+	CHECK(*alert->backupServers == 0);
+	CHECK(!alert->activeSessions);
+	CHECK(*alert->requeuedSessions == 0);
+	CHECK(*alert->queuedSessions == 0);
+}
+
+TEST_CASE("HAProxyAlertParser parses an alert without a check duration", "[HAProxyAlertParser]") {
+	auto alert = HAProxyAlertParser::parse(createAlertMessage(
+			"Server be/s1 is DOWN, reason: Layer4 connection problem, info: \"Connection refused\". "
+			"1 active and 0 backup servers left. 0 sessions active, 0 requeued, 0 remaining in queue"), false);
+	REQUIRE(alert);
+	CHECK(alert->state == "DOWN");
+	CHECK(*alert->reason == "Layer4 connection problem");
+	CHECK(*alert->info == "Connection refused");
+	CHECK(!alert->checkDuration);
+	CHECK(*alert->activeServers == 1);
+	CHECK(*alert->activeSessions == 0);
+}
+
+TEST_CASE("HAProxyAlertParser parses maintenance alerts", "[HAProxyAlertParser]") {
+	auto alert = HAProxyAlertParser::parse(createAlertMessage(
+			"Server be/s1 is going DOWN for maintenance. 1 active and 0 backup servers left. "
+			"0 sessions active, 0 requeued, 0 remaining in queue"), false);
+	REQUIRE(alert);
+	CHECK(alert->state == "going DOWN for maintenance");
+	CHECK(!alert->reason);
+	CHECK(*alert->activeServers == 1);
+}
+
+TEST_CASE("HAProxyAlertParser parses alerts of backup servers", "[HAProxyAlertParser]") {
+	auto alert = HAProxyAlertParser::parse(createAlertMessage(
+			"Backup Server be/bk1 is DOWN, reason: Layer4 timeout, check duration: 2002ms. "
+			"0 active and 0 backup servers left. Running on backup. "
+			"0 sessions active, 0 requeued, 0 remaining in queue"), false);
+	REQUIRE(alert);
+	CHECK(alert->proxy == "be");
+	CHECK(alert->server == "bk1");
+	CHECK(alert->backupServer);
+	CHECK(alert->state == "DOWN");
+	CHECK(*alert->checkDuration == 2002);
+	CHECK(*alert->backupServers == 0);
+	CHECK(alert->runningOnBackup);
+	CHECK(*alert->activeSessions == 0);
+	CHECK(alert->toJSON()["backupServer"] == true);
+}
+
+TEST_CASE("HAProxyAlertParser parses the body of known senders", "[HAProxyAlertParser]") {
+	std::string message =
+			"From: haproxy@example.com\n"
+			"Subject: alert\n"
+			"\n"
+			"\n"
+			"[HAproxy Alert] Server be/s1 is UP, reason: Layer4 check passed, check duration: 0ms. "
+			"1 active and 0 backup servers online. 0 sessions requeued, 0 total in queue  \n";
+	CHECK(!HAProxyAlertParser::parse(message, false));
+	auto alert = HAProxyAlertParser::parse(message, true);
+	REQUIRE(alert);
+	CHECK(alert->server == "s1");
+	CHECK(alert->state == "UP");
+	CHECK(*alert->queuedSessions == 0);
+}
+
+TEST_CASE("HAProxyAlertParser ignores other messages", "[HAProxyAlertParser]") {
+	CHECK(!HAProxyAlertParser::parse("Subject: hello\n\nServer be/s1 is DOWN\n", false));
+	CHECK(!HAProxyAlertParser::parse("Subject: [HAproxy Alert] Server be/s1 is DOWN", false));
+	CHECK(!HAProxyAlertParser::parse("", true));
+}
+
+TEST_CASE("HAProxyAlertParser rejects malformed alerts", "[HAProxyAlertParser]") {
+	CHECK(!HAProxyAlertParser::parse(createAlertMessage("Proxy be started."), false));
+	CHECK(!HAProxyAlertParser::parse(createAlertMessage("Server be-s1 is DOWN"), false));
+	CHECK(!HAProxyAlertParser::parse(createAlertMessage("Server be/s1 went DOWN"), false));
+	CHECK(!HAProxyAlertParser::parse(createAlertMessage("Server s1 is DOWN, proxy a/b"), false));
+	CHECK(!HAProxyAlertParser::parse(createAlertMessage("Server be/s1 is DOWN, info: \"unterminated"), false));
+}
+
+TEST_CASE("HAProxyAlertParser parses truncated alerts as far as they go", "[HAProxyAlertParser]") {
+	std::string full =
+			"Server be/s1 is DOWN, reason: Layer7 wrong status, code: 503, info: \"Service Unavailable\", "
+			"check duration: 12ms. 0 active and 0 backup servers left. 3 sessions active, 2 requeued, 1 remaining in queue";
+	for (size_t i = 0; i <= full.size(); ++i) {
+		INFO("Truncated at " << i);
+		auto alert = HAProxyAlertParser::parse(createAlertMessage(full.substr(0, i)), false);
+		if (alert) {
+			CHECK(alert->proxy == "be");
+			CHECK(alert->toJSON().is_object());
+		}
+	}
+	auto alert = HAProxyAlertParser::parse(createAlertMessage("Server be/s1 is DOWN, reason: Layer7 wrong status, code: 5"), false);
+	REQUIRE(alert);
+	CHECK(*alert->code == 5);
+	CHECK(!alert->checkDuration);
+	CHECK(!alert->activeServers);
+
+	alert = HAProxyAlertParser::parse(createAlertMessage("Server be/s1 is DOWN. 0 active and 2 back"), false);
+	REQUIRE(alert);
+	CHECK(*alert->activeServers == 0);
+	CHECK(*alert->backupServers == 2);
+	CHECK(!alert->activeSessions);
+
+	alert = HAProxyAlertParser::parse(createAlertMessage("Server be/s1 is DOWN. 0 active and"), false);
+	REQUIRE(alert);
+	CHECK(!alert->activeServers);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ConnectionLimiter
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+	// The home slot of an address in a table of the given size (the same 
+	// hash as ConnectionLimiter uses), to pick colliding addresses.
+	size_t getHomeSlot(const address& clientAddress, size_t slots) {
+		std::array<unsigned char, 16> key = {};
+		key[10] = key[11] = 0xff;
+		auto bytes = clientAddress.to_v4().to_bytes();
+		std::copy(bytes.begin(), bytes.end(), key.begin() + 12);
+		uint64_t hash = 14695981039346656037ULL;
+		for (auto c : key) {
+			hash = (hash ^ c) * 1099511628211ULL;
+		}
+		return (hash ^ (hash >> 32)) & (slots - 1);
+	}
+
+	// IPv4 addresses whose home slot in the initial (16-slot) table is one 
+	// of the given slots
+	std::vector<address> findAddresses(const std::vector<size_t>& homeSlots) {
+		std::vector<address> result;
+		for (uint32_t i = 1; result.size() < homeSlots.size(); ++i) {
+			address candidate = boost::asio::ip::address_v4(0x0a000000 + i);
+			if (getHomeSlot(candidate, 16) == homeSlots[result.size()]) {
+				result.push_back(candidate);
+			}
+		}
+		return result;
+	}
+
+	// Whether the address is at its limit (without changing the count)
+	bool isAtLimit(ConnectionLimiter& limiter, const address& clientAddress) {
+		if (limiter.acquire(clientAddress)) {
+			limiter.release(clientAddress);
+			return false;
+		}
+		return true;
+	}
+}
+
+TEST_CASE("ConnectionLimiter enforces the total and per-address limits", "[ConnectionLimiter]") {
+	ConnectionLimiter limiter(3, 2);
+	auto a = boost::asio::ip::make_address("192.0.2.1");
+	auto b = boost::asio::ip::make_address("2001:db8::1");
+	auto c = boost::asio::ip::make_address("192.0.2.3");
+	CHECK(limiter.acquire(a));
+	CHECK(limiter.acquire(a));
+	CHECK(!limiter.acquire(a));
+	CHECK(limiter.acquire(b));
+	CHECK(!limiter.acquire(c));
+	CHECK(limiter.getConnections() == 3);
+
+	limiter.release(a);
+	CHECK(limiter.acquire(c));
+	CHECK(!limiter.acquire(b));
+	limiter.release(b);
+	limiter.release(c);
+	CHECK(limiter.acquire(a));
+	CHECK(!limiter.acquire(a));
+	CHECK(limiter.getConnections() == 2);
+}
+
+TEST_CASE("ConnectionLimiter treats IPv4-mapped IPv6 addresses as IPv4", "[ConnectionLimiter]") {
+	ConnectionLimiter limiter(0, 1);
+	CHECK(limiter.acquire(boost::asio::ip::make_address("192.0.2.1")));
+	CHECK(!limiter.acquire(boost::asio::ip::make_address("::ffff:192.0.2.1")));
+	limiter.release(boost::asio::ip::make_address("::ffff:192.0.2.1"));
+	CHECK(limiter.getConnections() == 0);
+}
+
+TEST_CASE("ConnectionLimiter ignores releases of unknown addresses", "[ConnectionLimiter]") {
+	ConnectionLimiter limiter(0, 1);
+	limiter.release(boost::asio::ip::make_address("192.0.2.1"));
+	CHECK(limiter.getConnections() == 0);
+	CHECK(limiter.acquire(boost::asio::ip::make_address("192.0.2.1")));
+	limiter.release(boost::asio::ip::make_address("192.0.2.2"));
+	CHECK(limiter.getConnections() == 1);
+}
+
+TEST_CASE("ConnectionLimiter keeps colliding addresses that wrap around the table", "[ConnectionLimiter]") {
+	// 7 addresses (the most before the table grows) that probe from the last 
+	// slots, so their run wraps around to the start of the table
+	std::vector<address> addresses = findAddresses({15, 15, 14, 15, 0, 14, 1});
+	for (size_t removed = 0; removed < addresses.size(); ++removed) {
+		INFO("Removing address " << removed);
+		ConnectionLimiter limiter(0, 2);
+		for (const auto& a : addresses) {
+			REQUIRE(limiter.acquire(a));
+			REQUIRE(limiter.acquire(a));
+		}
+		for (const auto& a : addresses) {
+			CHECK(isAtLimit(limiter, a));
+		}
+
+		limiter.release(addresses[removed]);
+		limiter.release(addresses[removed]);
+		for (size_t i = 0; i < addresses.size(); ++i) {
+			CHECK(isAtLimit(limiter, addresses[i]) == (i != removed));
+		}
+		CHECK(limiter.getConnections() == 2 * (addresses.size() - 1));
+
+		// Remove the rest in a different order, checking the remaining ones each time
+		std::vector<bool> present(addresses.size(), true);
+		present[removed] = false;
+		for (size_t j = 0; j < addresses.size(); ++j) {
+			size_t next = (removed + 3 * j + 1) % addresses.size();
+			if (!present[next]) {
+				continue;
+			}
+			limiter.release(addresses[next]);
+			limiter.release(addresses[next]);
+			present[next] = false;
+			for (size_t i = 0; i < addresses.size(); ++i) {
+				CHECK(isAtLimit(limiter, addresses[i]) == present[i]);
+			}
+		}
+	}
+}
+
+TEST_CASE("ConnectionLimiter matches a reference model through growth and removal", "[ConnectionLimiter]") {
+	const size_t limit = 3;
+	ConnectionLimiter limiter(0, limit);
+	std::map<std::string, size_t> model;
+	std::vector<address> addresses;
+	for (uint32_t i = 0; i < 200; ++i) {
+		if (i % 3 == 0) {
+			boost::asio::ip::address_v6::bytes_type bytes = {{0x20, 0x01, 0x0d, 0xb8}};
+			bytes[14] = static_cast<unsigned char>(i >> 8);
+			bytes[15] = static_cast<unsigned char>(i);
+			addresses.push_back(boost::asio::ip::address_v6(bytes));
+		}
+		else {
+			addresses.push_back(boost::asio::ip::address_v4(0xc0000200 + i));
+		}
+	}
+	std::mt19937 random(42);
+	size_t connections = 0;
+	for (size_t step = 0; step < 20000; ++step) {
+		// Mostly acquire at first, then mostly release, so the table grows and empties
+		const address& a = addresses[random() % addresses.size()];
+		size_t& count = model[a.to_string()];
+		bool acquire = (random() % 100) < (step < 10000 ? 70u : 30u);
+		if (acquire) {
+			bool expected = count < limit;
+			REQUIRE(limiter.acquire(a) == expected);
+			if (expected) {
+				++count;
+				++connections;
+			}
+		}
+		else if (count > 0) {
+			limiter.release(a);
+			--count;
+			--connections;
+		}
+		REQUIRE(limiter.getConnections() == connections);
+	}
+	for (const auto& a : addresses) {
+		CHECK(isAtLimit(limiter, a) == (model[a.to_string()] == limit));
+	}
+}